@@ -21,37 +21,101 @@
  * for more details.
  */
 
+#include <string.h>
+
 #include "block-monitor.h"
+#include "hex-codec.h"
+#include "sha256d.h"
 
 #define CONFIG_GROUP_NAME "block-monitor"
 
-#define DEFAULT_LATENCY 250
+#define DEFAULT_LATENCY          250
+#define DEFAULT_FALLBACK_LATENCY 5000
+
+/* seconds before trying getblocktemplate long polling again after it
+   failed */
+#define LONGPOLL_RETRY_DELAY 30
+
+/* previous tips remembered, so that work from a lagging upstream
+   does not report them again as new */
+#define RECENT_TIPS 4
 
 struct _BlockMonitor
 {
   guint currentBlock;
 
+  /* best block hash, as found in block headers */
+  guint8 best_hash[32];
+  gboolean has_best_hash;
+  guint tip_changes;
+  guint check_tip_changes;
+
+  /* the height of a reported tip is a guess until a check confirms it */
+  gboolean tip_unconfirmed;
+  guint8 recent_tips[RECENT_TIPS][32];
+  guint recent_tips_len;
+
   gboolean started;
   gint src_id;
   guint latency;
+  guint fallback_latency;
 
   EvdJsonrpcHttpClient *rpc;
 
+  /* tip check in flight, and whether to ask again right after */
+  gboolean checking;
+  gboolean recheck;
+
+  /* push sources, polling is only a fallback while one of them works */
+  EvdJsonrpcHttpClient *longpoll_rpc;
+  gboolean longpolling;
+  gboolean longpoll_active;
+  gchar *longpoll_id;
+  guint longpoll_src_id;
+
+  EvdWebService *notify_service;
+  gchar *notify_addr;
+  gboolean notify_active;
+
   BlockMonitorChangeCb block_change_cb;
   BlockMonitorChangeCb block_change_cb_user_data;
 };
 
 
-static gboolean checkBlock (gpointer user_data);
+static gboolean checkBlock     (gpointer user_data);
+static gboolean start_longpoll (gpointer user_data);
 
 
+static void
+notify_on_request_headers (EvdWebService     *service,
+                           EvdHttpConnection *conn,
+                           EvdHttpRequest    *req,
+                           gpointer           user_data)
+{
+  BlockMonitor *self = user_data;
+
+  /* bitcoind -blocknotify, the block hash is not needed */
+  evd_web_service_respond (service,
+                           conn,
+                           SOUP_STATUS_OK,
+                           NULL,
+                           NULL,
+                           0,
+                           NULL);
+
+  block_monitor_check_now (self);
+}
+
 BlockMonitor *
 block_monitor_new (GKeyFile             *config,
                    EvdJsonrpcHttpClient *rpc_client,
+                   EvdJsonrpcHttpClient *longpoll_rpc_client,
                    BlockMonitorChangeCb  callback,
                    gpointer              user_data)
 {
   BlockMonitor *self;
+  GError *error = NULL;
+  gboolean longpoll;
 
   self = g_slice_new0 (BlockMonitor);
 
@@ -68,6 +132,44 @@ block_monitor_new (GKeyFile             *config,
   if (self->latency == 0)
     self->latency = DEFAULT_LATENCY;
 
+  self->fallback_latency = g_key_file_get_integer (config,
+                                                   CONFIG_GROUP_NAME,
+                                                   "fallback-latency",
+                                                   NULL);
+  if (self->fallback_latency == 0)
+    self->fallback_latency = DEFAULT_FALLBACK_LATENCY;
+
+  /* getblocktemplate long polling, on by default */
+  longpoll = g_key_file_get_boolean (config,
+                                     CONFIG_GROUP_NAME,
+                                     "longpoll",
+                                     &error);
+  if (error != NULL)
+    {
+      longpoll = TRUE;
+      g_clear_error (&error);
+    }
+
+  if (longpoll && longpoll_rpc_client != NULL)
+    {
+      self->longpoll_rpc = longpoll_rpc_client;
+      g_object_ref (self->longpoll_rpc);
+    }
+
+  /* endpoint for bitcoind's -blocknotify */
+  self->notify_addr = g_key_file_get_string (config,
+                                             CONFIG_GROUP_NAME,
+                                             "notify-listen-addr",
+                                             NULL);
+  if (self->notify_addr != NULL && self->notify_addr[0] != '\0')
+    {
+      self->notify_service = evd_web_service_new ();
+      g_signal_connect (self->notify_service,
+                        "request-headers",
+                        G_CALLBACK (notify_on_request_headers),
+                        self);
+    }
+
   return self;
 }
 
@@ -81,18 +183,123 @@ block_monitor_free (BlockMonitor *self)
 
   g_object_unref (self->rpc);
 
+  if (self->longpoll_rpc != NULL)
+    g_object_unref (self->longpoll_rpc);
+  g_free (self->longpoll_id);
+
+  if (self->notify_service != NULL)
+    g_object_unref (self->notify_service);
+  g_free (self->notify_addr);
+
   g_slice_free (BlockMonitor, self);
 }
 
+/* RPC gives hashes byte-reversed, headers hold them as is */
+static gboolean
+rpc_hash_to_hash (const gchar *rpc_hash, guint8 *hash)
+{
+  guint8 tmp[32];
+  gint i;
+
+  if (rpc_hash == NULL ||
+      strlen (rpc_hash) != 64 ||
+      ! hex_codec_decode (rpc_hash, tmp, 32))
+    {
+      return FALSE;
+    }
+
+  for (i=0; i<32; i++)
+    hash[i] = tmp[31 - i];
+
+  return TRUE;
+}
+
+/* any change of the best block counts, reorganizations included */
+static void
+set_tip (BlockMonitor *self, guint block, const guint8 *hash)
+{
+  if (self->has_best_hash && memcmp (self->best_hash, hash, 32) == 0)
+    {
+      /* same block, upstream just told its real height */
+      self->currentBlock = block;
+      self->tip_unconfirmed = FALSE;
+      return;
+    }
+
+  if (self->has_best_hash && block <= self->currentBlock)
+    g_print ("BLOCK-MONITOR: Chain reorganization, new tip at height %u\n",
+             block);
+
+  if (self->has_best_hash)
+    {
+      memmove (self->recent_tips[1],
+               self->recent_tips[0],
+               (RECENT_TIPS - 1) * 32);
+      memcpy (self->recent_tips[0], self->best_hash, 32);
+      self->recent_tips_len = MIN (self->recent_tips_len + 1, RECENT_TIPS);
+    }
+
+  self->tip_unconfirmed = FALSE;
+  memcpy (self->best_hash, hash, 32);
+  self->has_best_hash = TRUE;
+  self->currentBlock = block;
+  self->tip_changes++;
+
+  if (self->started)
+    self->block_change_cb (self,
+                           self->currentBlock,
+                           self->best_hash,
+                           self->block_change_cb_user_data);
+}
+
 static void
-on_block_count (GObject      *obj,
-                GAsyncResult *result,
-                gpointer      user_data)
+schedule_check (BlockMonitor *self)
+{
+  guint latency;
+
+  if (self->src_id != 0)
+    g_source_remove (self->src_id);
+
+  latency = self->longpoll_active || self->notify_active ?
+    self->fallback_latency : self->latency;
+
+  self->src_id = evd_timeout_add (NULL,
+                                  latency,
+                                  G_PRIORITY_HIGH,
+                                  checkBlock,
+                                  self);
+}
+
+static void
+check_done (BlockMonitor *self)
+{
+  self->checking = FALSE;
+
+  if (! self->started)
+    return;
+
+  if (self->recheck)
+    {
+      self->recheck = FALSE;
+      checkBlock (self);
+    }
+  else
+    {
+      schedule_check (self);
+    }
+}
+
+static void
+on_block_header (GObject      *obj,
+                 GAsyncResult *result,
+                 gpointer      user_data)
 {
   BlockMonitor *self = user_data;
   JsonNode *json_result;
   JsonNode *json_error;
+  JsonObject *header;
   GError *error = NULL;
+  guint8 hash[32];
 
   if (! evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
                                                     result,
@@ -100,34 +307,94 @@ on_block_count (GObject      *obj,
                                                     &json_error,
                                                     &error))
     {
-      g_print ("Get block count failed: %s\n", error->message);
+      g_print ("Get block header failed: %s\n", error->message);
       g_error_free (error);
     }
   else
     {
-      guint block;
-
-      block = json_node_get_int (json_result);
-      if (block > self->currentBlock)
+      /* a push source may have moved the tip meanwhile */
+      if (self->check_tip_changes == self->tip_changes &&
+          json_result != NULL &&
+          JSON_NODE_HOLDS_OBJECT (json_result))
         {
-          self->currentBlock = block;
-
-          if (self->started)
-            self->block_change_cb (self,
-                                   self->currentBlock,
-                                   self->block_change_cb_user_data);
+          header = json_node_get_object (json_result);
+
+          if (rpc_hash_to_hash (json_object_get_string_member (header, "hash"),
+                                hash))
+            {
+              set_tip (self,
+                       json_object_get_int_member (header, "height"),
+                       hash);
+            }
         }
 
       json_node_free (json_result);
       json_node_free (json_error);
     }
 
-  if (self->started)
-    self->src_id = evd_timeout_add (NULL,
-                                    self->latency,
-                                    G_PRIORITY_HIGH,
-                                    checkBlock,
-                                    self);
+  check_done (self);
+}
+
+static void
+on_best_block_hash (GObject      *obj,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  BlockMonitor *self = user_data;
+  JsonNode *json_result;
+  JsonNode *json_error;
+  GError *error = NULL;
+  const gchar *rpc_hash;
+  guint8 hash[32];
+  JsonNode *params;
+  JsonArray *arr;
+
+  if (! evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
+                                                    result,
+                                                    &json_result,
+                                                    &json_error,
+                                                    &error))
+    {
+      g_print ("Get best block hash failed: %s\n", error->message);
+      g_error_free (error);
+
+      check_done (self);
+      return;
+    }
+
+  rpc_hash = json_node_get_string (json_result);
+
+  if (self->check_tip_changes != self->tip_changes ||
+      ! rpc_hash_to_hash (rpc_hash, hash) ||
+      (self->has_best_hash &&
+       ! self->tip_unconfirmed &&
+       memcmp (self->best_hash, hash, 32) == 0))
+    {
+      json_node_free (json_result);
+      json_node_free (json_error);
+
+      check_done (self);
+      return;
+    }
+
+  /* the tip moved, its header tells the height */
+  params = json_node_new (JSON_NODE_ARRAY);
+  arr = json_array_new ();
+  json_node_set_array (params, arr);
+  json_array_add_string_element (arr, rpc_hash);
+
+  evd_jsonrpc_http_client_call_method (self->rpc,
+                                       "getblockheader",
+                                       params,
+                                       NULL,
+                                       on_block_header,
+                                       self);
+
+  json_array_unref (arr);
+  json_node_free (params);
+
+  json_node_free (json_result);
+  json_node_free (json_error);
 }
 
 static gboolean
@@ -136,16 +403,180 @@ checkBlock (gpointer user_data)
   BlockMonitor *self = user_data;
 
   self->src_id = 0;
+  self->checking = TRUE;
+  self->check_tip_changes = self->tip_changes;
 
   evd_jsonrpc_http_client_call_method (self->rpc,
-                                       "getblockcount",
+                                       "getbestblockhash",
+                                       NULL,
                                        NULL,
+                                       on_best_block_hash,
+                                       self);
+  return FALSE;
+}
+
+static void
+longpoll_failed (BlockMonitor *self)
+{
+  /* back to polling at full rate until long polling works again */
+  self->longpoll_active = FALSE;
+  g_free (self->longpoll_id);
+  self->longpoll_id = NULL;
+
+  if (self->started && ! self->checking)
+    schedule_check (self);
+
+  self->longpoll_src_id = evd_timeout_add (NULL,
+                                           LONGPOLL_RETRY_DELAY * 1000,
+                                           G_PRIORITY_DEFAULT,
+                                           start_longpoll,
+                                           self);
+}
+
+static void
+on_longpoll (GObject      *obj,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  BlockMonitor *self = user_data;
+  JsonNode *json_result;
+  JsonNode *json_error;
+  JsonObject *tmpl;
+  GError *error = NULL;
+  guint8 hash[32];
+
+  self->longpolling = FALSE;
+
+  if (! evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
+                                                    result,
+                                                    &json_result,
+                                                    &json_error,
+                                                    &error))
+    {
+      if (! self->started)
+        {
+          g_error_free (error);
+          return;
+        }
+
+      g_print ("Block template long polling failed: %s\n", error->message);
+      g_error_free (error);
+
+      longpoll_failed (self);
+      return;
+    }
+
+  if (! self->started)
+    {
+      json_node_free (json_result);
+      json_node_free (json_error);
+      return;
+    }
+
+  if (json_result == NULL || ! JSON_NODE_HOLDS_OBJECT (json_result))
+    {
+      g_print ("Block template long polling not supported upstream\n");
+
+      json_node_free (json_result);
+      json_node_free (json_error);
+
+      longpoll_failed (self);
+      return;
+    }
+
+  tmpl = json_node_get_object (json_result);
+
+  /* the template builds on top of the current tip */
+  if (json_object_has_member (tmpl, "height") &&
+      json_object_has_member (tmpl, "previousblockhash") &&
+      rpc_hash_to_hash (json_object_get_string_member (tmpl,
+                                                       "previousblockhash"),
+                        hash))
+    {
+      set_tip (self, json_object_get_int_member (tmpl, "height") - 1, hash);
+    }
+
+  g_free (self->longpoll_id);
+  self->longpoll_id = NULL;
+  if (json_object_has_member (tmpl, "longpollid"))
+    self->longpoll_id =
+      g_strdup (json_object_get_string_member (tmpl, "longpollid"));
+
+  json_node_free (json_result);
+  json_node_free (json_error);
+
+  if (self->longpoll_id == NULL)
+    {
+      g_print ("Block template long polling not supported upstream\n");
+      longpoll_failed (self);
+      return;
+    }
+
+  self->longpoll_active = TRUE;
+  start_longpoll (self);
+}
+
+/* a getblocktemplate call that upstream answers once the best block
+   changes, or right away when there is no long poll id yet */
+static gboolean
+start_longpoll (gpointer user_data)
+{
+  BlockMonitor *self = user_data;
+  JsonNode *params;
+  JsonArray *arr;
+  JsonObject *obj;
+  JsonArray *rules;
+
+  self->longpoll_src_id = 0;
+  self->longpolling = TRUE;
+
+  rules = json_array_new ();
+  json_array_add_string_element (rules, "segwit");
+
+  obj = json_object_new ();
+  json_object_set_array_member (obj, "rules", rules);
+  if (self->longpoll_id != NULL)
+    json_object_set_string_member (obj, "longpollid", self->longpoll_id);
+
+  params = json_node_new (JSON_NODE_ARRAY);
+  arr = json_array_new ();
+  json_node_set_array (params, arr);
+  json_array_add_object_element (arr, obj);
+
+  evd_jsonrpc_http_client_call_method (self->longpoll_rpc,
+                                       "getblocktemplate",
+                                       params,
                                        NULL,
-                                       on_block_count,
+                                       on_longpoll,
                                        self);
+
+  json_array_unref (arr);
+  json_node_free (params);
+
   return FALSE;
 }
 
+static void
+notify_on_listen (GObject      *obj,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  BlockMonitor *self = user_data;
+  GError *error = NULL;
+
+  if (! evd_service_listen_finish (EVD_SERVICE (obj), result, &error))
+    {
+      g_print ("BLOCK-MONITOR: Block notify endpoint failed: %s\n",
+               error->message);
+      g_error_free (error);
+      return;
+    }
+
+  g_print ("BLOCK-MONITOR: Listening for block notifications on %s\n",
+           self->notify_addr);
+  self->notify_active = TRUE;
+}
+
 void
 block_monitor_start (BlockMonitor *self)
 {
@@ -157,6 +588,20 @@ block_monitor_start (BlockMonitor *self)
 
   self->started = TRUE;
   checkBlock (self);
+
+  if (self->longpoll_rpc != NULL &&
+      ! self->longpolling &&
+      self->longpoll_src_id == 0)
+    {
+      start_longpoll (self);
+    }
+
+  if (self->notify_service != NULL && ! self->notify_active)
+    evd_service_listen (EVD_SERVICE (self->notify_service),
+                        self->notify_addr,
+                        NULL,
+                        notify_on_listen,
+                        self);
 }
 
 void
@@ -172,4 +617,90 @@ block_monitor_stop (BlockMonitor *self)
       g_source_remove (self->src_id);
       self->src_id = 0;
     }
+
+  if (self->longpoll_src_id > 0)
+    {
+      g_source_remove (self->longpoll_src_id);
+      self->longpoll_src_id = 0;
+    }
+  self->longpoll_active = FALSE;
+}
+
+/* asks upstream for the best block right away, e.g. when told that a
+   new block arrived */
+void
+block_monitor_check_now (BlockMonitor *self)
+{
+  if (! self->started)
+    return;
+
+  if (self->checking)
+    {
+      self->recheck = TRUE;
+      return;
+    }
+
+  if (self->src_id != 0)
+    g_source_remove (self->src_id);
+
+  checkBlock (self);
+}
+
+static void
+advance_tip (BlockMonitor *self, const guint8 *hash)
+{
+  /* most likely one block on top, the check below tells for sure */
+  set_tip (self, self->currentBlock + 1, hash);
+  self->tip_unconfirmed = TRUE;
+
+  block_monitor_check_now (self);
+}
+
+/* 'hash' was seen as previous block of fresh upstream work, which often
+   happens before a poll would notice the new block. Only a 'trusted'
+   source, i.e. the node this monitor asks, moves the tip right away */
+void
+block_monitor_report_tip (BlockMonitor *self,
+                          const guint8 *hash,
+                          gboolean      trusted)
+{
+  guint i;
+
+  if (! self->started || ! self->has_best_hash)
+    return;
+
+  if (memcmp (self->best_hash, hash, 32) == 0)
+    return;
+
+  for (i=0; i<self->recent_tips_len; i++)
+    if (memcmp (self->recent_tips[i], hash, 32) == 0)
+      return;
+
+  /* a node on a fork or far behind, or the tip just guessed is not
+     confirmed yet; ask instead of guessing again */
+  if (! trusted || self->tip_unconfirmed)
+    {
+      block_monitor_check_now (self);
+      return;
+    }
+
+  advance_tip (self, hash);
+}
+
+/* upstream accepted a block of ours, with 'header' as found in blocks */
+void
+block_monitor_report_block_found (BlockMonitor *self, const guint8 *header)
+{
+  guint8 hash[32];
+
+  if (! self->started || ! self->has_best_hash)
+    return;
+
+  /* only a block on top of the current tip becomes the new one */
+  if (memcmp (header + 4, self->best_hash, 32) != 0)
+    return;
+
+  sha256d_hash_header (header, hash);
+
+  advance_tip (self, hash);
 }
@@ -30,18 +30,28 @@ G_BEGIN_DECLS
 
 typedef struct _BlockMonitor BlockMonitor;
 
+/* 'hash' is the new best block hash, byte ordered as in block headers */
 typedef void (* BlockMonitorChangeCb) (BlockMonitor *self,
                                        guint         block,
+                                       const guint8 *hash,
                                        gpointer      user_data);
 
-BlockMonitor *  block_monitor_new             (GKeyFile             *config,
-                                               EvdJsonrpcHttpClient *rpc_client,
-                                               BlockMonitorChangeCb  callback,
-                                               gpointer              user_data);
-void            block_monitor_free            (BlockMonitor *self);
-
-void            block_monitor_start           (BlockMonitor *self);
-void            block_monitor_stop            (BlockMonitor *self);
+BlockMonitor *  block_monitor_new                (GKeyFile             *config,
+                                                  EvdJsonrpcHttpClient *rpc_client,
+                                                  EvdJsonrpcHttpClient *longpoll_rpc_client,
+                                                  BlockMonitorChangeCb  callback,
+                                                  gpointer              user_data);
+void            block_monitor_free               (BlockMonitor *self);
+
+void            block_monitor_start              (BlockMonitor *self);
+void            block_monitor_stop               (BlockMonitor *self);
+
+void            block_monitor_check_now          (BlockMonitor *self);
+void            block_monitor_report_tip         (BlockMonitor *self,
+                                                  const guint8 *hash,
+                                                  gboolean      trusted);
+void            block_monitor_report_block_found (BlockMonitor *self,
+                                                  const guint8 *header);
 
 G_END_DECLS
 
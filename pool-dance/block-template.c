@@ -0,0 +1,742 @@
+/*
+ * block-template.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include "block-template.h"
+
+#include "hex-codec.h"
+#include "sha256d.h"
+
+#define COINBASE_TAG "/pool-dance/"
+
+#define WORK_DATA_PADDING \
+  "000000800000000000000000000000000000000000000000" \
+  "000000000000000000000000000000000000000080020000"
+
+static const gchar base58_digits[] =
+  "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+struct _BlockTemplate
+{
+  gint ref_count;
+
+  guint height;
+  guint32 version;
+  guint32 bits;
+  guint32 curtime;
+  guint8 prev_hash[32];
+
+  GByteArray *coinbase1;
+  GByteArray *coinbase2;
+  gboolean has_witness;
+
+  guint8 *merkle_branch;
+  guint merkle_branch_len;
+
+  GPtrArray *txs_data;
+};
+
+static void
+write_uint32_le (guint8 *buf, guint32 value)
+{
+  buf[0] = value & 0xFF;
+  buf[1] = (value >> 8) & 0xFF;
+  buf[2] = (value >> 16) & 0xFF;
+  buf[3] = (value >> 24) & 0xFF;
+}
+
+static void
+append_uint32_le (GByteArray *arr, guint32 value)
+{
+  guint8 buf[4];
+
+  write_uint32_le (buf, value);
+  g_byte_array_append (arr, buf, 4);
+}
+
+static void
+append_uint64_le (GByteArray *arr, guint64 value)
+{
+  append_uint32_le (arr, value & 0xFFFFFFFF);
+  append_uint32_le (arr, value >> 32);
+}
+
+static void
+append_varint (GByteArray *arr, guint64 value)
+{
+  guint8 prefix;
+
+  if (value < 0xFD)
+    {
+      prefix = value;
+      g_byte_array_append (arr, &prefix, 1);
+    }
+  else if (value <= 0xFFFF)
+    {
+      guint8 buf[3] = { 0xFD, value & 0xFF, (value >> 8) & 0xFF };
+
+      g_byte_array_append (arr, buf, 3);
+    }
+  else if (value <= 0xFFFFFFFF)
+    {
+      prefix = 0xFE;
+      g_byte_array_append (arr, &prefix, 1);
+      append_uint32_le (arr, value);
+    }
+  else
+    {
+      prefix = 0xFF;
+      g_byte_array_append (arr, &prefix, 1);
+      append_uint64_le (arr, value);
+    }
+}
+
+static void
+append_push (GByteArray *arr, const guint8 *data, guint8 size)
+{
+  g_byte_array_append (arr, &size, 1);
+  g_byte_array_append (arr, data, size);
+}
+
+/* BIP34: the coinbase script must start with the block height */
+static void
+append_script_height (GByteArray *arr, guint height)
+{
+  guint8 num[5];
+  guint8 opcode;
+  guint len = 0;
+
+  if (height <= 16)
+    {
+      opcode = height == 0 ? 0x00 : 0x50 + height;
+      g_byte_array_append (arr, &opcode, 1);
+      return;
+    }
+
+  while (height > 0)
+    {
+      num[len++] = height & 0xFF;
+      height >>= 8;
+    }
+
+  /* keep the number positive */
+  if (num[len - 1] & 0x80)
+    num[len++] = 0x00;
+
+  append_push (arr, num, len);
+}
+
+static gboolean
+hex_to_hash (const gchar *hex, guint8 *hash)
+{
+  guint8 tmp[32];
+  gint i;
+
+  if (hex == NULL || strlen (hex) != 64 || ! hex_codec_decode (hex, tmp, 32))
+    return FALSE;
+
+  /* RPC shows hashes in reversed byte order */
+  for (i=0; i<32; i++)
+    hash[i] = tmp[31 - i];
+
+  return TRUE;
+}
+
+/* NULL unless the member is there and holds a string */
+static const gchar *
+get_string_member (JsonObject *obj, const gchar *name)
+{
+  JsonNode *node;
+
+  node = json_object_get_member (obj, name);
+  if (node == NULL ||
+      ! JSON_NODE_HOLDS_VALUE (node) ||
+      json_node_get_value_type (node) != G_TYPE_STRING)
+    {
+      return NULL;
+    }
+
+  return json_node_get_string (node);
+}
+
+static gboolean
+build_coinbase (BlockTemplate  *self,
+                JsonObject     *obj,
+                GByteArray     *payout_script,
+                GError        **error)
+{
+  GByteArray *script_sig;
+  guint8 prev_out[36];
+  guint8 byte;
+  gint64 value;
+
+  value = json_object_get_int_member (obj, "coinbasevalue");
+
+  /* the script-sig is split around the extranonce push */
+  script_sig = g_byte_array_new ();
+  append_script_height (script_sig, self->height);
+
+  self->coinbase1 = g_byte_array_new ();
+  self->coinbase2 = g_byte_array_new ();
+
+  /* version, one input spending the null outpoint */
+  append_uint32_le (self->coinbase1, 1);
+  append_varint (self->coinbase1, 1);
+  memset (prev_out, 0, 32);
+  memset (prev_out + 32, 0xFF, 4);
+  g_byte_array_append (self->coinbase1, prev_out, sizeof (prev_out));
+
+  append_varint (self->coinbase1,
+                 script_sig->len +
+                 1 + BLOCK_TEMPLATE_EXTRANONCE_SIZE +
+                 1 + strlen (COINBASE_TAG));
+  g_byte_array_append (self->coinbase1, script_sig->data, script_sig->len);
+
+  byte = BLOCK_TEMPLATE_EXTRANONCE_SIZE;
+  g_byte_array_append (self->coinbase1, &byte, 1);
+
+  g_byte_array_unref (script_sig);
+
+  /* extranonce goes here */
+
+  append_push (self->coinbase2,
+               (const guint8 *) COINBASE_TAG,
+               strlen (COINBASE_TAG));
+  append_uint32_le (self->coinbase2, 0xFFFFFFFF);
+
+  /* outputs */
+  append_varint (self->coinbase2, self->has_witness ? 2 : 1);
+
+  append_uint64_le (self->coinbase2, value);
+  append_varint (self->coinbase2, payout_script->len);
+  g_byte_array_append (self->coinbase2, payout_script->data, payout_script->len);
+
+  if (self->has_witness)
+    {
+      const gchar *commitment;
+      gsize len;
+      guint8 *script;
+
+      commitment = json_object_get_string_member (obj,
+                                                  "default_witness_commitment");
+      len = strlen (commitment) / 2;
+      script = g_new (guint8, len);
+      if (! hex_codec_decode (commitment, script, len))
+        {
+          g_free (script);
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "Invalid witness commitment in block template");
+          return FALSE;
+        }
+
+      append_uint64_le (self->coinbase2, 0);
+      append_varint (self->coinbase2, len);
+      g_byte_array_append (self->coinbase2, script, len);
+
+      g_free (script);
+    }
+
+  /* lock time */
+  append_uint32_le (self->coinbase2, 0);
+
+  return TRUE;
+}
+
+static gboolean
+build_merkle_branch (BlockTemplate  *self,
+                     JsonArray      *txs,
+                     GError        **error)
+{
+  guint8 *level;
+  guint level_len;
+  guint8 pair[64];
+  guint i;
+
+  /* first slot is the coinbase, which is not known yet */
+  level_len = json_array_get_length (txs) + 1;
+  level = g_new0 (guint8, (level_len + 1) * 32);
+
+  for (i=1; i<level_len; i++)
+    {
+      JsonNode *node;
+      JsonObject *tx;
+      const gchar *txid;
+      const gchar *data;
+
+      node = json_array_get_element (txs, i - 1);
+      if (! JSON_NODE_HOLDS_OBJECT (node))
+        {
+          g_free (level);
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "Invalid transaction in block template");
+          return FALSE;
+        }
+      tx = json_node_get_object (node);
+
+      if (json_object_has_member (tx, "txid"))
+        txid = get_string_member (tx, "txid");
+      else
+        txid = get_string_member (tx, "hash");
+
+      if (! hex_to_hash (txid, level + i * 32))
+        {
+          g_free (level);
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "Invalid transaction id in block template");
+          return FALSE;
+        }
+
+      data = get_string_member (tx, "data");
+      if (data == NULL)
+        {
+          g_free (level);
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "Invalid transaction data in block template");
+          return FALSE;
+        }
+
+      g_ptr_array_add (self->txs_data, g_strdup (data));
+    }
+
+  self->merkle_branch = g_new (guint8, 32 * g_bit_storage (level_len));
+  self->merkle_branch_len = 0;
+
+  while (level_len > 1)
+    {
+      memcpy (self->merkle_branch + self->merkle_branch_len * 32,
+              level + 32,
+              32);
+      self->merkle_branch_len++;
+
+      if (level_len % 2 != 0)
+        {
+          memcpy (level + level_len * 32, level + (level_len - 1) * 32, 32);
+          level_len++;
+        }
+
+      for (i=2; i<level_len; i+=2)
+        {
+          memcpy (pair, level + i * 32, 64);
+          sha256d_hash (pair, 64, level + (i / 2) * 32);
+        }
+
+      level_len /= 2;
+    }
+
+  g_free (level);
+
+  return TRUE;
+}
+
+static void
+block_template_free (BlockTemplate *self)
+{
+  if (self->coinbase1 != NULL)
+    g_byte_array_unref (self->coinbase1);
+  if (self->coinbase2 != NULL)
+    g_byte_array_unref (self->coinbase2);
+
+  g_free (self->merkle_branch);
+  g_ptr_array_unref (self->txs_data);
+
+  g_slice_free (BlockTemplate, self);
+}
+
+/* public methods */
+
+BlockTemplate *
+block_template_new (JsonNode    *gbt_result,
+                    GByteArray  *payout_script,
+                    GError     **error)
+{
+  BlockTemplate *self;
+  JsonObject *obj;
+  const gchar *bits;
+  guint8 bits_bin[4];
+
+  if (! JSON_NODE_HOLDS_OBJECT (gbt_result))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Block template is not an object");
+      return NULL;
+    }
+
+  obj = json_node_get_object (gbt_result);
+
+  if (! json_object_has_member (obj, "previousblockhash") ||
+      ! json_object_has_member (obj, "transactions") ||
+      ! json_object_has_member (obj, "coinbasevalue") ||
+      ! json_object_has_member (obj, "bits"))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Block template is missing required fields");
+      return NULL;
+    }
+
+  self = g_slice_new0 (BlockTemplate);
+  self->ref_count = 1;
+
+  self->txs_data = g_ptr_array_new_with_free_func (g_free);
+
+  self->height = json_object_get_int_member (obj, "height");
+  self->version = json_object_get_int_member (obj, "version");
+  self->curtime = json_object_get_int_member (obj, "curtime");
+
+  bits = json_object_get_string_member (obj, "bits");
+  if (bits == NULL ||
+      strlen (bits) != 8 ||
+      ! hex_codec_decode (bits, bits_bin, 4))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid bits in block template");
+      goto err;
+    }
+  self->bits = (bits_bin[0] << 24) | (bits_bin[1] << 16) |
+    (bits_bin[2] << 8) | bits_bin[3];
+
+  if (! hex_to_hash (json_object_get_string_member (obj, "previousblockhash"),
+                     self->prev_hash))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid previous block hash in block template");
+      goto err;
+    }
+
+  self->has_witness = json_object_has_member (obj, "default_witness_commitment");
+
+  if (! build_coinbase (self, obj, payout_script, error))
+    goto err;
+
+  if (! JSON_NODE_HOLDS_ARRAY (json_object_get_member (obj, "transactions")))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid transactions in block template");
+      goto err;
+    }
+
+  if (! build_merkle_branch (self,
+                             json_object_get_array_member (obj, "transactions"),
+                             error))
+    {
+      goto err;
+    }
+
+  return self;
+
+ err:
+  block_template_free (self);
+
+  return NULL;
+}
+
+BlockTemplate *
+block_template_ref (BlockTemplate *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (self->ref_count > 0, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+
+  return self;
+}
+
+void
+block_template_unref (BlockTemplate *self)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->ref_count > 0);
+
+  if (g_atomic_int_dec_and_test (&self->ref_count))
+    block_template_free (self);
+}
+
+guint
+block_template_get_height (BlockTemplate *self)
+{
+  return self->height;
+}
+
+guint32
+block_template_get_version (BlockTemplate *self)
+{
+  return self->version;
+}
+
+guint32
+block_template_get_bits (BlockTemplate *self)
+{
+  return self->bits;
+}
+
+guint32
+block_template_get_curtime (BlockTemplate *self)
+{
+  return self->curtime;
+}
+
+const guint8 *
+block_template_get_prev_hash (BlockTemplate *self)
+{
+  return self->prev_hash;
+}
+
+GByteArray *
+block_template_get_coinbase1 (BlockTemplate *self)
+{
+  return self->coinbase1;
+}
+
+GByteArray *
+block_template_get_coinbase2 (BlockTemplate *self)
+{
+  return self->coinbase2;
+}
+
+const guint8 *
+block_template_get_merkle_branch (BlockTemplate *self, guint *len)
+{
+  if (len != NULL)
+    *len = self->merkle_branch_len;
+
+  return self->merkle_branch;
+}
+
+void
+block_template_build_header (BlockTemplate *self,
+                             const guint8  *extranonce,
+                             guint32        ntime,
+                             guint32        nonce,
+                             guint8        *header)
+{
+  GByteArray *coinbase;
+  guint8 pair[64];
+  guint i;
+
+  /* hash the coinbase for this extranonce */
+  coinbase = g_byte_array_sized_new (self->coinbase1->len +
+                                     BLOCK_TEMPLATE_EXTRANONCE_SIZE +
+                                     self->coinbase2->len);
+  g_byte_array_append (coinbase, self->coinbase1->data, self->coinbase1->len);
+  g_byte_array_append (coinbase, extranonce, BLOCK_TEMPLATE_EXTRANONCE_SIZE);
+  g_byte_array_append (coinbase, self->coinbase2->data, self->coinbase2->len);
+
+  sha256d_hash (coinbase->data, coinbase->len, pair);
+  g_byte_array_unref (coinbase);
+
+  /* walk up the merkle branch */
+  for (i=0; i<self->merkle_branch_len; i++)
+    {
+      memcpy (pair + 32, self->merkle_branch + i * 32, 32);
+      sha256d_hash (pair, 64, pair);
+    }
+
+  write_uint32_le (header, self->version);
+  memcpy (header + 4, self->prev_hash, 32);
+  memcpy (header + 36, pair, 32);
+  write_uint32_le (header + 68, ntime);
+  write_uint32_le (header + 72, self->bits);
+  write_uint32_le (header + 76, nonce);
+}
+
+gchar *
+block_template_build_block_hex (BlockTemplate *self,
+                                const guint8  *header,
+                                const guint8  *extranonce)
+{
+  GByteArray *head;
+  GString *block;
+  gchar *hex;
+  guint i;
+  guint8 witness[34] = { 0x01, 0x20, };
+
+  head = g_byte_array_new ();
+  g_byte_array_append (head, header, BLOCK_TEMPLATE_HEADER_SIZE);
+  append_varint (head, self->txs_data->len + 1);
+
+  block = g_string_new (NULL);
+
+  hex = hex_codec_encode_dup (head->data, head->len);
+  g_string_append (block, hex);
+  g_free (hex);
+  g_byte_array_unref (head);
+
+  /* coinbase transaction */
+  if (! self->has_witness)
+    {
+      hex = hex_codec_encode_dup (self->coinbase1->data, self->coinbase1->len);
+      g_string_append (block, hex);
+      g_free (hex);
+
+      hex = hex_codec_encode_dup (extranonce, BLOCK_TEMPLATE_EXTRANONCE_SIZE);
+      g_string_append (block, hex);
+      g_free (hex);
+
+      hex = hex_codec_encode_dup (self->coinbase2->data, self->coinbase2->len);
+      g_string_append (block, hex);
+      g_free (hex);
+    }
+  else
+    {
+      /* version, segwit marker and flag, the rest of the transaction,
+         the witness reserved value and the lock time */
+      hex = hex_codec_encode_dup (self->coinbase1->data, 4);
+      g_string_append (block, hex);
+      g_free (hex);
+
+      g_string_append (block, "0001");
+
+      hex = hex_codec_encode_dup (self->coinbase1->data + 4,
+                                  self->coinbase1->len - 4);
+      g_string_append (block, hex);
+      g_free (hex);
+
+      hex = hex_codec_encode_dup (extranonce, BLOCK_TEMPLATE_EXTRANONCE_SIZE);
+      g_string_append (block, hex);
+      g_free (hex);
+
+      hex = hex_codec_encode_dup (self->coinbase2->data,
+                                  self->coinbase2->len - 4);
+      g_string_append (block, hex);
+      g_free (hex);
+
+      hex = hex_codec_encode_dup (witness, sizeof (witness));
+      g_string_append (block, hex);
+      g_free (hex);
+
+      hex = hex_codec_encode_dup (self->coinbase2->data +
+                                  self->coinbase2->len - 4,
+                                  4);
+      g_string_append (block, hex);
+      g_free (hex);
+    }
+
+  /* the rest of transactions */
+  for (i=0; i<self->txs_data->len; i++)
+    g_string_append (block, g_ptr_array_index (self->txs_data, i));
+
+  return g_string_free (block, FALSE);
+}
+
+/* getwork data is the block header with the bytes of each 32 bits word
+   swapped, plus SHA256 padding */
+void
+block_template_header_to_work_data (const guint8 *header, gchar *data)
+{
+  hex_codec_encode_swap32 (header, BLOCK_TEMPLATE_HEADER_SIZE, data);
+  memcpy (data + BLOCK_TEMPLATE_HEADER_SIZE * 2,
+          WORK_DATA_PADDING,
+          strlen (WORK_DATA_PADDING) + 1);
+}
+
+gboolean
+block_template_work_data_to_header (const gchar *data, guint8 *header)
+{
+  return hex_codec_decode_swap32 (data, header, BLOCK_TEMPLATE_HEADER_SIZE);
+}
+
+GByteArray *
+block_template_address_to_script (const gchar *address, GError **error)
+{
+  guint8 bin[25] = {0, };
+  guint8 checksum[32];
+  GByteArray *script;
+  const gchar *p;
+  gint i;
+
+  for (p = address; *p != '\0'; p++)
+    {
+      const gchar *digit;
+      guint carry;
+
+      digit = strchr (base58_digits, *p);
+      if (digit == NULL)
+        goto invalid;
+
+      carry = digit - base58_digits;
+      for (i=sizeof (bin)-1; i>=0; i--)
+        {
+          carry += 58 * bin[i];
+          bin[i] = carry & 0xFF;
+          carry >>= 8;
+        }
+
+      if (carry != 0)
+        goto invalid;
+    }
+
+  sha256d_hash (bin, 21, checksum);
+  if (memcmp (checksum, bin + 21, 4) != 0)
+    goto invalid;
+
+  script = g_byte_array_new ();
+
+  switch (bin[0])
+    {
+    case 0x00:
+    case 0x6F:
+      /* pay-to-pubkey-hash */
+      g_byte_array_append (script, (const guint8 *) "\x76\xa9\x14", 3);
+      g_byte_array_append (script, bin + 1, 20);
+      g_byte_array_append (script, (const guint8 *) "\x88\xac", 2);
+      break;
+
+    case 0x05:
+    case 0xC4:
+      /* pay-to-script-hash */
+      g_byte_array_append (script, (const guint8 *) "\xa9\x14", 2);
+      g_byte_array_append (script, bin + 1, 20);
+      g_byte_array_append (script, (const guint8 *) "\x87", 1);
+      break;
+
+    default:
+      g_byte_array_unref (script);
+      goto invalid;
+    }
+
+  return script;
+
+ invalid:
+  g_set_error (error,
+               G_IO_ERROR,
+               G_IO_ERROR_INVALID_ARGUMENT,
+               "Invalid Bitcoin address '%s'",
+               address);
+  return NULL;
+}
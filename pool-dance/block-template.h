@@ -0,0 +1,87 @@
+/*
+ * block-template.h
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#ifndef __BLOCK_TEMPLATE_H__
+#define __BLOCK_TEMPLATE_H__
+
+#include <evd.h>
+
+G_BEGIN_DECLS
+
+/* the coinbase reserves room for a per-session (extranonce1) and a
+   per-miner (extranonce2) counter, which are rolled to produce unique
+   merkle roots out of a single template */
+#define BLOCK_TEMPLATE_EXTRANONCE1_SIZE 4
+#define BLOCK_TEMPLATE_EXTRANONCE2_SIZE 4
+#define BLOCK_TEMPLATE_EXTRANONCE_SIZE  (BLOCK_TEMPLATE_EXTRANONCE1_SIZE + \
+                                         BLOCK_TEMPLATE_EXTRANONCE2_SIZE)
+
+/* extranonce1 used for work built locally by the upstream service,
+   Stratum sessions never get it */
+#define BLOCK_TEMPLATE_LOCAL_EXTRANONCE1 0
+
+/* how far past the template's curtime miners may roll the block time */
+#define BLOCK_TEMPLATE_MAX_NTIME_DRIFT 7200
+
+#define BLOCK_TEMPLATE_HEADER_SIZE    80
+#define BLOCK_TEMPLATE_WORK_DATA_SIZE 256
+
+typedef struct _BlockTemplate BlockTemplate;
+
+BlockTemplate *     block_template_new                 (JsonNode    *gbt_result,
+                                                        GByteArray  *payout_script,
+                                                        GError     **error);
+BlockTemplate *     block_template_ref                 (BlockTemplate *self);
+void                block_template_unref               (BlockTemplate *self);
+
+guint               block_template_get_height          (BlockTemplate *self);
+guint32             block_template_get_version         (BlockTemplate *self);
+guint32             block_template_get_bits            (BlockTemplate *self);
+guint32             block_template_get_curtime         (BlockTemplate *self);
+const guint8 *      block_template_get_prev_hash       (BlockTemplate *self);
+
+GByteArray *        block_template_get_coinbase1       (BlockTemplate *self);
+GByteArray *        block_template_get_coinbase2       (BlockTemplate *self);
+const guint8 *      block_template_get_merkle_branch   (BlockTemplate *self,
+                                                        guint         *len);
+
+void                block_template_build_header        (BlockTemplate *self,
+                                                        const guint8  *extranonce,
+                                                        guint32        ntime,
+                                                        guint32        nonce,
+                                                        guint8        *header);
+gchar *             block_template_build_block_hex     (BlockTemplate *self,
+                                                        const guint8  *header,
+                                                        const guint8  *extranonce);
+
+void                block_template_header_to_work_data (const guint8 *header,
+                                                        gchar        *data);
+gboolean            block_template_work_data_to_header (const gchar *data,
+                                                        guint8      *header);
+
+GByteArray *        block_template_address_to_script   (const gchar  *address,
+                                                        GError      **error);
+
+G_END_DECLS
+
+#endif /* __BLOCK_TEMPLATE_H__ */
@@ -116,6 +116,22 @@ get_client_info (WorkRequest *request)
   return info;
 }
 
+static ClientInfo *
+get_work_result_client_info (WorkResult *result)
+{
+  ClientInfo *info;
+
+  info = g_slice_new0 (ClientInfo);
+
+  work_result_get_client_info (result,
+                               &info->user,
+                               &info->passw,
+                               &info->remote_addr,
+                               &info->user_agent);
+
+  return info;
+}
+
 static void
 client_info_free (ClientInfo *info)
 {
@@ -135,7 +151,7 @@ event_dispatcher_notify_work_validated (EventDispatcher *self,
 {
   ClientInfo *info;
 
-  info = get_client_info ((WorkRequest *) work_result);
+  info = get_work_result_client_info (work_result);
 
   if (self->vtable != NULL)
     {
@@ -157,13 +173,14 @@ event_dispatcher_notify_work_validated (EventDispatcher *self,
       accepted = (error_code == WORK_VALIDATOR_ERROR_SUCCESS);
 
       if (accepted)
-        entry = g_strdup_printf ("[%s]\t%s\t\"%s\"\t\"%s\"\t%s\t\"%s\"",
+        entry = g_strdup_printf ("[%s]\t%s\t\"%s\"\t\"%s\"\t%s\t\"%s\"\t%.3f",
                                  date_str,
                                  "WORK-ACCEPTED",
                                  info->user,
                                  info->passw,
                                  info->remote_addr,
-                                 info->user_agent);
+                                 info->user_agent,
+                                 work_result_get_difficulty (work_result));
       else
         entry = g_strdup_printf ("[%s]\t%s\t\"%s\"\t\"%s\"\t%s\t\"%s\"\t%s\t\"%s\"",
                                  date_str,
@@ -253,7 +270,7 @@ event_dispatcher_notify_work_submitted (EventDispatcher *self,
 {
   ClientInfo *info;
 
-  info = get_client_info ((WorkRequest *) work_result);
+  info = get_work_result_client_info (work_result);
 
   /* @TODO: call virtual method */
 
@@ -301,6 +318,76 @@ event_dispatcher_notify_current_block (EventDispatcher *self, guint block)
     }
 }
 
+/* 'count' is the total of upstream work items dropped for being on top
+   of an older block */
+void
+event_dispatcher_notify_stale_work (EventDispatcher *self, guint64 count)
+{
+  if (self->logger != NULL)
+    {
+      gchar *entry;
+      gchar *date_str;
+
+      date_str = get_timestamp_str ();
+
+      entry = g_strdup_printf ("[%s]\tSTALE-WORK\t%" G_GUINT64_FORMAT,
+                               date_str,
+                               count);
+      g_free (date_str);
+
+      file_logger_log (self->logger, entry);
+      g_free (entry);
+    }
+}
+
+/* 'shares' arrived for a block before the validator knew of it, over
+'duration' microseconds */
+void
+event_dispatcher_notify_validator_not_ready (EventDispatcher *self,
+                                             guint            shares,
+                                             gint64           duration)
+{
+  if (self->logger != NULL)
+    {
+      gchar *entry;
+      gchar *date_str;
+
+      date_str = get_timestamp_str ();
+
+      entry = g_strdup_printf ("[%s]\tVALIDATOR-NOT-READY\t%u\t%.1f",
+                               date_str,
+                               shares,
+                               duration / 1000.0);
+      g_free (date_str);
+
+      file_logger_log (self->logger, entry);
+      g_free (entry);
+    }
+}
+
+void
+event_dispatcher_notify_lp_burst (EventDispatcher *self,
+                                  guint            miners,
+                                  gint64           duration)
+{
+  if (self->logger != NULL)
+    {
+      gchar *entry;
+      gchar *date_str;
+
+      date_str = get_timestamp_str ();
+
+      entry = g_strdup_printf ("[%s]\tLP-BURST\t%u\t%.1f",
+                               date_str,
+                               miners,
+                               duration / 1000.0);
+      g_free (date_str);
+
+      file_logger_log (self->logger, entry);
+      g_free (entry);
+    }
+}
+
 void
 event_dispatcher_notify_block_found (EventDispatcher *self,
                                      guint            block,
@@ -308,7 +395,7 @@ event_dispatcher_notify_block_found (EventDispatcher *self,
 {
   ClientInfo *info;
 
-  info = get_client_info ((WorkRequest *) work_result);
+  info = get_work_result_client_info (work_result);
 
   /*
   info = g_slice_new0 (ClientInfo);
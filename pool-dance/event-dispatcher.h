@@ -51,36 +51,44 @@ typedef struct
 } EventDispatcherVTable;
 
 
-EventDispatcher * event_dispatcher_new                   (const gchar  *log_file_name,
-                                                          GError      **error);
-void              event_dispatcher_free                  (EventDispatcher *self);
-
-void              event_dispatcher_notify_work_validated (EventDispatcher *self,
-                                                          WorkResult      *work_result,
-                                                          guint            error_code,
-                                                          const gchar     *reason);
-
-void              event_dispatcher_notify_work_sent      (EventDispatcher *self,
-                                                          WorkRequest     *work_request,
-                                                          JsonNode        *work_item);
-
-void              event_dispatcher_notify_work_requested (EventDispatcher *self,
-                                                          WorkRequest     *work_request);
-
-void              event_dispatcher_notify_work_submitted (EventDispatcher *self,
-                                                          WorkResult      *work_result);
-
-void              event_dispatcher_notify_current_block  (EventDispatcher *self,
-                                                          guint            block);
-
-void              event_dispatcher_notify_block_found    (EventDispatcher *self,
-                                                          guint            block,
-                                                          WorkResult      *work_result);
-
-void              event_dispatcher_set_vtable            (EventDispatcher       *self,
-                                                          EventDispatcherVTable *vtable,
-                                                          gpointer               user_data,
-                                                          GDestroyNotify         user_data_free_func);
+EventDispatcher * event_dispatcher_new                        (const gchar  *log_file_name,
+                                                               GError      **error);
+void              event_dispatcher_free                       (EventDispatcher *self);
+
+void              event_dispatcher_notify_work_validated      (EventDispatcher *self,
+                                                               WorkResult      *work_result,
+                                                               guint            error_code,
+                                                               const gchar     *reason);
+
+void              event_dispatcher_notify_work_sent           (EventDispatcher *self,
+                                                               WorkRequest     *work_request,
+                                                               JsonNode        *work_item);
+
+void              event_dispatcher_notify_work_requested      (EventDispatcher *self,
+                                                               WorkRequest     *work_request);
+
+void              event_dispatcher_notify_work_submitted      (EventDispatcher *self,
+                                                               WorkResult      *work_result);
+
+void              event_dispatcher_notify_current_block       (EventDispatcher *self,
+                                                               guint            block);
+void              event_dispatcher_notify_stale_work          (EventDispatcher *self,
+                                                               guint64          count);
+void              event_dispatcher_notify_validator_not_ready (EventDispatcher *self,
+                                                               guint            shares,
+                                                               gint64           duration);
+void              event_dispatcher_notify_lp_burst            (EventDispatcher *self,
+                                                               guint            miners,
+                                                               gint64           duration);
+
+void              event_dispatcher_notify_block_found         (EventDispatcher *self,
+                                                               guint            block,
+                                                               WorkResult      *work_result);
+
+void              event_dispatcher_set_vtable                 (EventDispatcher       *self,
+                                                               EventDispatcherVTable *vtable,
+                                                               gpointer               user_data,
+                                                               GDestroyNotify         user_data_free_func);
 
 G_END_DECLS
 
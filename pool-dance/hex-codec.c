@@ -0,0 +1,432 @@
+/*
+ * hex-codec.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#if defined (__x86_64__) || defined (__i386__)
+#if defined (__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define HAVE_X86_INTRINSICS 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif
+
+#include "hex-codec.h"
+
+/* 'swap' is 0 for a plain conversion, or 3 to reverse the bytes of each
+   32 bits word, which is what getwork data needs (byte i goes to i ^ 3) */
+typedef gboolean (* DecodeFunc) (const gchar *hex,
+                                 guint8      *bin,
+                                 gsize        size,
+                                 guint        swap);
+typedef void     (* EncodeFunc) (const guint8 *bin,
+                                 gsize         size,
+                                 gchar        *hex,
+                                 guint         swap);
+
+static const gchar hex_digits[] = "0123456789abcdef";
+
+/* digit value plus one, zero for anything that is not a hex digit */
+static const guint8 hex_values[256] =
+  {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+  };
+
+static gboolean decode_generic (const gchar *hex,
+                                guint8      *bin,
+                                gsize        size,
+                                guint        swap);
+static void     encode_generic (const guint8 *bin,
+                                gsize         size,
+                                gchar        *hex,
+                                guint         swap);
+
+/* usable before hex_codec_init() is called */
+static DecodeFunc decode = decode_generic;
+static EncodeFunc encode = encode_generic;
+static const gchar *implementation_name = "generic";
+
+static gboolean
+decode_generic (const gchar *hex, guint8 *bin, gsize size, guint swap)
+{
+  gsize i;
+  guint hi;
+  guint lo;
+
+  for (i=0; i<size; i++)
+    {
+      hi = hex_values[(guint8) hex[i*2]];
+      lo = hex_values[(guint8) hex[i*2 + 1]];
+      if (hi == 0 || lo == 0)
+        return FALSE;
+
+      bin[i ^ swap] = ((hi - 1) << 4) | (lo - 1);
+    }
+
+  return TRUE;
+}
+
+static void
+encode_generic (const guint8 *bin, gsize size, gchar *hex, guint swap)
+{
+  gsize i;
+  guint8 byte;
+
+  for (i=0; i<size; i++)
+    {
+      byte = bin[i ^ swap];
+      hex[i*2] = hex_digits[byte >> 4];
+      hex[i*2 + 1] = hex_digits[byte & 0x0F];
+    }
+}
+
+#ifdef HAVE_X86_INTRINSICS
+
+/* turns 16 hex characters into their nibble values, and 'valid' into
+   all ones if every character is a hex digit */
+__attribute__ ((target ("ssse3"), always_inline))
+static inline __m128i
+nibbles_ssse3 (__m128i chars, __m128i *valid)
+{
+  __m128i digit;
+  __m128i alpha;
+  __m128i is_digit;
+  __m128i is_alpha;
+
+  digit = _mm_sub_epi8 (chars, _mm_set1_epi8 ('0'));
+  alpha = _mm_sub_epi8 (_mm_or_si128 (chars, _mm_set1_epi8 (0x20)),
+                        _mm_set1_epi8 ('a'));
+
+  /* unsigned range checks, anything below the base wraps around */
+  is_digit = _mm_cmpeq_epi8 (_mm_min_epu8 (digit, _mm_set1_epi8 (9)), digit);
+  is_alpha = _mm_cmpeq_epi8 (_mm_min_epu8 (alpha, _mm_set1_epi8 (5)), alpha);
+
+  *valid = _mm_or_si128 (is_digit, is_alpha);
+
+  return _mm_or_si128 (_mm_and_si128 (is_digit, digit),
+                       _mm_and_si128 (is_alpha,
+                                      _mm_add_epi8 (alpha,
+                                                    _mm_set1_epi8 (10))));
+}
+
+/* the 128 bits loops are inlined into the AVX2 versions for the tails,
+   so they get VEX encoded there and avoid SSE/AVX transitions */
+__attribute__ ((target ("ssse3"), always_inline))
+static inline gboolean
+decode_ssse3_inline (const gchar *hex, guint8 *bin, gsize size, guint swap)
+{
+  __m128i pick;
+  __m128i chars;
+  __m128i values;
+  __m128i valid;
+  gsize i;
+
+  /* after merging nibble pairs, each byte sits in the low half of a
+     16 bits lane */
+  pick = swap ?
+    _mm_setr_epi8 (6, 4, 2, 0, 14, 12, 10, 8, -1, -1, -1, -1, -1, -1, -1, -1) :
+    _mm_setr_epi8 (0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+
+  for (i=0; i + 8 <= size; i += 8)
+    {
+      chars = _mm_loadu_si128 ((const __m128i *) (hex + i*2));
+      values = nibbles_ssse3 (chars, &valid);
+      if (_mm_movemask_epi8 (valid) != 0xFFFF)
+        return FALSE;
+
+      values = _mm_maddubs_epi16 (values, _mm_set1_epi16 (0x0110));
+      _mm_storel_epi64 ((__m128i *) (bin + i),
+                        _mm_shuffle_epi8 (values, pick));
+    }
+
+  return decode_generic (hex + i*2, bin + i, size - i, swap);
+}
+
+__attribute__ ((target ("ssse3"), always_inline))
+static inline void
+encode_ssse3_inline (const guint8 *bin, gsize size, gchar *hex, guint swap)
+{
+  __m128i digits;
+  __m128i order;
+  __m128i bytes;
+  __m128i hi;
+  __m128i lo;
+  gsize i;
+
+  digits = _mm_loadu_si128 ((const __m128i *) hex_digits);
+  order = swap ?
+    _mm_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+    _mm_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+  for (i=0; i + 16 <= size; i += 16)
+    {
+      bytes = _mm_loadu_si128 ((const __m128i *) (bin + i));
+      bytes = _mm_shuffle_epi8 (bytes, order);
+
+      hi = _mm_and_si128 (_mm_srli_epi16 (bytes, 4), _mm_set1_epi8 (0x0F));
+      lo = _mm_and_si128 (bytes, _mm_set1_epi8 (0x0F));
+      hi = _mm_shuffle_epi8 (digits, hi);
+      lo = _mm_shuffle_epi8 (digits, lo);
+
+      _mm_storeu_si128 ((__m128i *) (hex + i*2), _mm_unpacklo_epi8 (hi, lo));
+      _mm_storeu_si128 ((__m128i *) (hex + i*2 + 16),
+                        _mm_unpackhi_epi8 (hi, lo));
+    }
+
+  encode_generic (bin + i, size - i, hex + i*2, swap);
+}
+
+__attribute__ ((target ("ssse3")))
+static gboolean
+decode_ssse3 (const gchar *hex, guint8 *bin, gsize size, guint swap)
+{
+  return decode_ssse3_inline (hex, bin, size, swap);
+}
+
+__attribute__ ((target ("ssse3")))
+static void
+encode_ssse3 (const guint8 *bin, gsize size, gchar *hex, guint swap)
+{
+  encode_ssse3_inline (bin, size, hex, swap);
+}
+
+__attribute__ ((target ("avx2")))
+static gboolean
+decode_avx2 (const gchar *hex, guint8 *bin, gsize size, guint swap)
+{
+  __m256i pick;
+  __m256i chars;
+  __m256i digit;
+  __m256i alpha;
+  __m256i is_digit;
+  __m256i is_alpha;
+  __m256i values;
+  gsize i;
+
+  pick = swap ?
+    _mm256_setr_epi8 (6, 4, 2, 0, 14, 12, 10, 8, -1, -1, -1, -1, -1, -1, -1, -1,
+                      6, 4, 2, 0, 14, 12, 10, 8, -1, -1, -1, -1, -1, -1, -1, -1) :
+    _mm256_setr_epi8 (0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1,
+                      0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+
+  for (i=0; i + 16 <= size; i += 16)
+    {
+      chars = _mm256_loadu_si256 ((const __m256i *) (hex + i*2));
+
+      digit = _mm256_sub_epi8 (chars, _mm256_set1_epi8 ('0'));
+      alpha = _mm256_sub_epi8 (_mm256_or_si256 (chars, _mm256_set1_epi8 (0x20)),
+                               _mm256_set1_epi8 ('a'));
+      is_digit = _mm256_cmpeq_epi8 (_mm256_min_epu8 (digit,
+                                                     _mm256_set1_epi8 (9)),
+                                    digit);
+      is_alpha = _mm256_cmpeq_epi8 (_mm256_min_epu8 (alpha,
+                                                     _mm256_set1_epi8 (5)),
+                                    alpha);
+      if (_mm256_movemask_epi8 (_mm256_or_si256 (is_digit, is_alpha)) != -1)
+        return FALSE;
+
+      values = _mm256_or_si256 (_mm256_and_si256 (is_digit, digit),
+                                _mm256_and_si256 (is_alpha,
+                                                  _mm256_add_epi8 (alpha,
+                                                                   _mm256_set1_epi8 (10))));
+      values = _mm256_maddubs_epi16 (values, _mm256_set1_epi16 (0x0110));
+      values = _mm256_shuffle_epi8 (values, pick);
+
+      /* each 128 bits lane holds 8 bytes in its low half */
+      values = _mm256_permute4x64_epi64 (values, 0x08);
+      _mm_storeu_si128 ((__m128i *) (bin + i), _mm256_castsi256_si128 (values));
+    }
+
+  return decode_ssse3_inline (hex + i*2, bin + i, size - i, swap);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+encode_avx2 (const guint8 *bin, gsize size, gchar *hex, guint swap)
+{
+  __m256i digits;
+  __m256i order;
+  __m256i bytes;
+  __m256i hi;
+  __m256i lo;
+  __m256i first;
+  __m256i second;
+  gsize i;
+
+  digits = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) hex_digits));
+  order = swap ?
+    _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+    _mm256_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                      0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+  for (i=0; i + 32 <= size; i += 32)
+    {
+      bytes = _mm256_loadu_si256 ((const __m256i *) (bin + i));
+      bytes = _mm256_shuffle_epi8 (bytes, order);
+
+      hi = _mm256_and_si256 (_mm256_srli_epi16 (bytes, 4),
+                             _mm256_set1_epi8 (0x0F));
+      lo = _mm256_and_si256 (bytes, _mm256_set1_epi8 (0x0F));
+      hi = _mm256_shuffle_epi8 (digits, hi);
+      lo = _mm256_shuffle_epi8 (digits, lo);
+
+      /* unpacking works within 128 bits lanes, put them back in order */
+      first = _mm256_unpacklo_epi8 (hi, lo);
+      second = _mm256_unpackhi_epi8 (hi, lo);
+      _mm256_storeu_si256 ((__m256i *) (hex + i*2),
+                           _mm256_permute2x128_si256 (first, second, 0x20));
+      _mm256_storeu_si256 ((__m256i *) (hex + i*2 + 32),
+                           _mm256_permute2x128_si256 (first, second, 0x31));
+    }
+
+  encode_ssse3_inline (bin + i, size - i, hex + i*2, swap);
+}
+
+static gboolean
+cpu_has_ssse3 (void)
+{
+  guint eax, ebx, ecx, edx;
+
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return FALSE;
+
+  return (ecx & bit_SSSE3) != 0;
+}
+
+static gboolean
+cpu_has_avx2 (void)
+{
+  guint eax, ebx, ecx, edx;
+
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx) ||
+      (ecx & bit_OSXSAVE) == 0 ||
+      (ecx & bit_AVX) == 0 ||
+      (ecx & bit_SSSE3) == 0)
+    {
+      return FALSE;
+    }
+
+  /* the OS must preserve the YMM registers */
+  __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  if ((eax & 0x6) != 0x6)
+    return FALSE;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+  return (ebx & bit_AVX2) != 0;
+}
+
+#endif /* HAVE_X86_INTRINSICS */
+
+/* public methods */
+
+void
+hex_codec_init (void)
+{
+  hex_codec_init_with_features (HEX_CODEC_FEATURE_ALL);
+}
+
+/* picks the fastest implementation among those allowed by 'features'
+   and supported by the CPU, and returns the feature it ended up using */
+guint
+hex_codec_init_with_features (guint features)
+{
+  decode = decode_generic;
+  encode = encode_generic;
+  implementation_name = "generic";
+
+#ifdef HAVE_X86_INTRINSICS
+  if ((features & HEX_CODEC_FEATURE_AVX2) != 0 && cpu_has_avx2 ())
+    {
+      decode = decode_avx2;
+      encode = encode_avx2;
+      implementation_name = "avx2";
+
+      return HEX_CODEC_FEATURE_AVX2;
+    }
+  else if ((features & HEX_CODEC_FEATURE_SSSE3) != 0 && cpu_has_ssse3 ())
+    {
+      decode = decode_ssse3;
+      encode = encode_ssse3;
+      implementation_name = "ssse3";
+
+      return HEX_CODEC_FEATURE_SSSE3;
+    }
+#endif
+
+  return 0;
+}
+
+const gchar *
+hex_codec_get_implementation_name (void)
+{
+  return implementation_name;
+}
+
+/* decodes 'size' bytes from the first 'size' * 2 characters of 'hex' */
+gboolean
+hex_codec_decode (const gchar *hex, guint8 *bin, gsize size)
+{
+  return decode (hex, bin, size, 0);
+}
+
+/* 'hex' must have room for 'size' * 2 characters plus the terminating NUL */
+void
+hex_codec_encode (const guint8 *bin, gsize size, gchar *hex)
+{
+  encode (bin, size, hex, 0);
+  hex[size*2] = '\0';
+}
+
+gchar *
+hex_codec_encode_dup (const guint8 *bin, gsize size)
+{
+  gchar *hex;
+
+  hex = g_new (gchar, size * 2 + 1);
+  hex_codec_encode (bin, size, hex);
+
+  return hex;
+}
+
+/* same as hex_codec_decode(), but the bytes of each 32 bits word come
+   out reversed. 'size' must be a multiple of 4 */
+gboolean
+hex_codec_decode_swap32 (const gchar *hex, guint8 *bin, gsize size)
+{
+  return decode (hex, bin, size, 3);
+}
+
+/* same as hex_codec_encode(), reversing the bytes of each 32 bits word
+   of 'bin'. 'size' must be a multiple of 4 */
+void
+hex_codec_encode_swap32 (const guint8 *bin, gsize size, gchar *hex)
+{
+  encode (bin, size, hex, 3);
+  hex[size*2] = '\0';
+}
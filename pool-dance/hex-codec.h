@@ -0,0 +1,62 @@
+/*
+ * hex-codec.h
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#ifndef __HEX_CODEC_H__
+#define __HEX_CODEC_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  HEX_CODEC_FEATURE_SSSE3 = 1 << 0,
+  HEX_CODEC_FEATURE_AVX2  = 1 << 1,
+
+  HEX_CODEC_FEATURE_ALL   = (1 << 2) - 1
+} HexCodecFeatures;
+
+void            hex_codec_init                    (void);
+guint           hex_codec_init_with_features      (guint features);
+const gchar *   hex_codec_get_implementation_name (void);
+
+gboolean        hex_codec_decode                  (const gchar *hex,
+                                                   guint8      *bin,
+                                                   gsize        size);
+void            hex_codec_encode                  (const guint8 *bin,
+                                                   gsize         size,
+                                                   gchar        *hex);
+
+gchar *         hex_codec_encode_dup              (const guint8 *bin,
+                                                   gsize         size);
+
+gboolean        hex_codec_decode_swap32           (const gchar *hex,
+                                                   guint8      *bin,
+                                                   gsize        size);
+void            hex_codec_encode_swap32           (const guint8 *bin,
+                                                   gsize         size,
+                                                   gchar        *hex);
+
+G_END_DECLS
+
+#endif /* __HEX_CODEC_H__ */
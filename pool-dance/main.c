@@ -29,6 +29,9 @@
 #include "work-validator.h"
 #include "event-dispatcher.h"
 #include "round-manager.h"
+#include "stratum-server.h"
+#include "sha256d.h"
+#include "hex-codec.h"
 
 #define CONFIG_GROUP_NAME "pool-dance"
 
@@ -38,14 +41,23 @@
 
 #define EASY_TARGET "ffffffffffffffffffffffffffffffffffffffffffffffffffffffff00000000"
 
+/* getwork requests served per main loop iteration */
+#define SERVE_WORK_BATCH_SIZE 64
+
 static UpstreamService *upstream_service;
 static BlockMonitor *block_monitor;
 static PoolServer *pool_server;
 static WorkValidator *work_validator;
 static EventDispatcher *event_dispatcher;
 static RoundManager *round_manager;
+static StratumServer *stratum_server = NULL;
 
 static guint current_block = 0;
+static guint serve_work_src_id = 0;
+
+/* delivery of the first work of a new block to long-polling miners */
+static gint64 lp_burst_start = 0;
+static guint lp_burst_size = 0;
 static GError *error = NULL;
 
 static gchar *config_file_name = NULL;
@@ -68,46 +80,59 @@ on_submit_work (GObject      *obj,
                 GAsyncResult *result,
                 gpointer      user_data)
 {
-  JsonNode *json_result;
-  JsonNode *json_error;
   GError *error = NULL;
   WorkResult *work_result = user_data;
-
-  if (! evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
-                                                    result,
-                                                    &json_result,
-                                                    &json_error,
-                                                    &error))
+  gboolean accepted;
+  gboolean by_primary;
+
+  if (! upstream_service_submit_work_finish (upstream_service,
+                                             result,
+                                             &accepted,
+                                             &by_primary,
+                                             &error))
     {
       g_print ("Work submit failed: %s\n", error->message);
       g_error_free (error);
     }
-  else
+  else if (accepted)
     {
-      if (json_node_get_boolean (json_result))
-        {
-          /* new block found! \o/ */
-          event_dispatcher_notify_block_found (event_dispatcher,
-                                               current_block,
-                                               work_result);
-        }
+      /* new block found! \o/ */
+      event_dispatcher_notify_block_found (event_dispatcher,
+                                           current_block,
+                                           work_result);
 
-      json_node_free (json_result);
-      json_node_free (json_error);
+      /* move the whole pool to the new block right away, rather than
+         hashing on the old one until the monitor notices. Only the
+         primary node's word counts, it is the one the monitor asks */
+      if (by_primary && work_result_get_header (work_result) != NULL)
+        block_monitor_report_block_found (block_monitor,
+                                          work_result_get_header (work_result));
+      else
+        block_monitor_check_now (block_monitor);
     }
 
   work_result_unref (work_result);
 }
 
 static void
-work_validator_on_validate (GObject      *obj,
-                            GAsyncResult *res,
-                            gpointer      user_data)
+respond_work_result (WorkResult  *work_result,
+                     gboolean     accepted,
+                     const gchar *reason)
 {
-  GError *error = NULL;
-  WorkResult *work_result = user_data;
+  if (EVD_IS_HTTP_CONNECTION (work_result_get_connection (work_result)))
+    pool_server_respond_putwork (pool_server, work_result, accepted, reason);
+  else
+    stratum_server_respond_submit (stratum_server, work_result, accepted, reason);
+}
 
-  if (work_validator_validate_finish (work_validator, res, &error))
+static void
+work_validator_on_verdict (WorkValidator      *self,
+                           WorkResult         *work_result,
+                           WorkValidatorError  verdict,
+                           const gchar        *reason,
+                           gpointer            user_data)
+{
+  if (verdict == WORK_VALIDATOR_ERROR_SUCCESS)
     {
       /* work is accepted! */
       event_dispatcher_notify_work_validated (event_dispatcher,
@@ -115,32 +140,30 @@ work_validator_on_validate (GObject      *obj,
                                               WORK_VALIDATOR_ERROR_SUCCESS,
                                               NULL);
 
-      pool_server_respond_putwork (pool_server, work_result, TRUE, NULL);
+      respond_work_result (work_result, TRUE, NULL);
 
-      /* submit work upstream to try find a block */
-      work_result_ref (work_result);
-      evd_jsonrpc_http_client_call_method (upstream_service_get_rpc (upstream_service),
-                                           "getwork",
-                                           work_result_get_json_node (work_result),
-                                           NULL,
-                                           on_submit_work,
-                                           work_result);
+      /* submit work upstream only if it can actually make a block */
+      if (work_result_is_block_candidate (work_result))
+        {
+          work_result_ref (work_result);
+          upstream_service_submit_work (upstream_service,
+                                        work_result,
+                                        on_submit_work,
+                                        work_result);
+        }
     }
   else
     {
       /* work is rejected */
       event_dispatcher_notify_work_validated (event_dispatcher,
                                               work_result,
-                                              error->code,
-                                              error->message);
+                                              verdict,
+                                              reason);
 
-      pool_server_respond_putwork (pool_server,
-                                   work_result,
-                                   FALSE,
-                                   error->message);
-      g_error_free (error);
+      respond_work_result (work_result, FALSE, reason);
     }
 
+  /* drop the reference handed over by pool_server_on_putwork() */
   work_result_unref (work_result);
 }
 
@@ -149,31 +172,48 @@ pool_server_on_putwork (PoolServer *self,
                         WorkResult *work_result,
                         gpointer    user_data)
 {
+  /* notify first, the validator may answer (and release the work
+     result) before returning */
+  event_dispatcher_notify_work_submitted (event_dispatcher, work_result);
+
   /* pass work to validator */
-  work_validator_validate (work_validator,
-                           work_result,
-                           NULL,
-                           work_validator_on_validate,
-                           work_result);
+  work_validator_validate (work_validator, work_result);
+}
 
-  event_dispatcher_notify_work_submitted (event_dispatcher, work_result);
+static void
+stratum_server_on_submit (StratumServer *self,
+                          WorkResult    *work_result,
+                          gpointer       user_data)
+{
+  /* the work was handed out as part of a job, let the validator know
+     about it before validating */
+  work_validator_track_work_result (work_validator, work_result);
+
+  pool_server_on_putwork (pool_server, work_result, NULL);
 }
 
-static gboolean
-serve_work (gpointer user_data)
+static void
+upstream_service_on_template (UpstreamService *self,
+                              BlockTemplate   *block_template,
+                              gboolean         clean,
+                              gpointer         user_data)
+{
+  stratum_server_notify_template (stratum_server, block_template, clean);
+}
+
+static void
+serve_work_request (void)
 {
   WorkRequest *work_request;
   JsonNode *work_item;
   JsonObject *obj;
-
-  if (! pool_server_need_work (pool_server) ||
-      ! upstream_service_has_work (upstream_service))
-    {
-      return FALSE;
-    }
+  BlockTemplate *block_template;
+  guint8 extranonce[BLOCK_TEMPLATE_EXTRANONCE_SIZE];
 
   work_request = pool_server_get_work_request (pool_server);
-  work_item = upstream_service_get_work (upstream_service);
+  work_item = upstream_service_get_work (upstream_service,
+                                         &block_template,
+                                         extranonce);
 
   /* set easy target */
   obj = json_node_get_object (work_item);
@@ -188,14 +228,69 @@ serve_work (gpointer user_data)
       work_validator_track_work_sent (work_validator,
                                       work_request,
                                       work_item,
-                                      upstream_service);
+                                      block_template,
+                                      extranonce);
+
+      json_node_free (work_item);
+    }
+  else
+    {
+      /* the miner is gone, the work is still good for someone else */
+      upstream_service_return_work (upstream_service, work_item);
     }
 
-  json_node_free (work_item);
   work_request_unref (work_request);
 
-  return pool_server_need_work (pool_server) &&
-    upstream_service_has_work (upstream_service);
+  if (lp_burst_start != 0 &&
+      pool_server_get_pending_lp_requests (pool_server) == 0)
+    {
+      event_dispatcher_notify_lp_burst (event_dispatcher,
+                                        lp_burst_size,
+                                        g_get_monotonic_time () - lp_burst_start);
+      lp_burst_start = 0;
+    }
+}
+
+static gboolean
+serve_work (gpointer user_data)
+{
+  guint pending;
+  guint i;
+
+  for (i=0; i<SERVE_WORK_BATCH_SIZE; i++)
+    {
+      if (! pool_server_need_work (pool_server))
+        {
+          serve_work_src_id = 0;
+          return FALSE;
+        }
+
+      if (! upstream_service_has_work (upstream_service))
+        {
+          /* fetch work for everyone waiting in one go */
+          pending = pool_server_get_pending_requests (pool_server);
+          upstream_service_prefetch_work (upstream_service, pending);
+
+          serve_work_src_id = 0;
+          return FALSE;
+        }
+
+      serve_work_request ();
+    }
+
+  /* let other events in before the next batch */
+  return TRUE;
+}
+
+static void
+schedule_serve_work (void)
+{
+  if (serve_work_src_id == 0)
+    serve_work_src_id = evd_timeout_add (NULL,
+                                         0,
+                                         G_PRIORITY_DEFAULT,
+                                         serve_work,
+                                         NULL);
 }
 
 static void
@@ -203,11 +298,16 @@ upstream_service_on_has_work (UpstreamService *upstream_service,
                               JsonNode        *work,
                               gpointer         user_data)
 {
-  evd_timeout_add (NULL,
-                   0,
-                   G_PRIORITY_DEFAULT,
-                   serve_work,
-                   NULL);
+  schedule_serve_work ();
+}
+
+static void
+upstream_service_on_tip (UpstreamService *upstream_service,
+                         const guint8    *prev_hash,
+                         gboolean         primary,
+                         gpointer         user_data)
+{
+  block_monitor_report_tip (block_monitor, prev_hash, primary);
 }
 
 static void
@@ -217,25 +317,44 @@ pool_server_on_getwork (PoolServer  *self,
 {
   event_dispatcher_notify_work_requested (event_dispatcher, work_request);
 
-  evd_timeout_add (NULL,
-                   0,
-                   G_PRIORITY_DEFAULT,
-                   serve_work,
-                   NULL);
+  schedule_serve_work ();
 }
 
 static void
 block_monitor_on_block_change (BlockMonitor *block_monitor,
                                guint         block,
+                               const guint8 *hash,
                                gpointer      user_data)
 {
+  guint not_ready_shares;
+  gint64 not_ready_time;
+
   current_block = block;
 
-  upstream_service_notify_new_block (upstream_service, block);
+  upstream_service_notify_new_block (upstream_service, block, hash);
   pool_server_notify_new_block (pool_server, block);
-  work_validator_notify_new_block (work_validator, block);
+  work_validator_notify_new_block (work_validator, block, hash);
+
+  work_validator_get_not_ready_window (work_validator,
+                                       &not_ready_shares,
+                                       &not_ready_time);
+  if (not_ready_shares > 0)
+    event_dispatcher_notify_validator_not_ready (event_dispatcher,
+                                                 not_ready_shares,
+                                                 not_ready_time);
+
+  /* long-polling miners are now waiting for work, ask upstream for all
+     of it at once instead of a cache refill at a time */
+  lp_burst_size = pool_server_get_pending_lp_requests (pool_server);
+  lp_burst_start = lp_burst_size > 0 ? g_get_monotonic_time () : 0;
+
+  upstream_service_prefetch_work (upstream_service,
+                                  pool_server_get_pending_requests (pool_server));
+  schedule_serve_work ();
 
   event_dispatcher_notify_current_block (event_dispatcher, block);
+  event_dispatcher_notify_stale_work (event_dispatcher,
+                                      upstream_service_get_stale_work_count (upstream_service));
 }
 
 /*
@@ -320,6 +439,8 @@ main (gint argc, gchar *argv[])
 
   g_type_init ();
   evd_tls_init (NULL);
+  sha256d_init ();
+  hex_codec_init ();
 
   /* parse command line */
   context = g_option_context_new ("- Lightweight and memory efficient Bitcoin mining pool");
@@ -360,18 +481,49 @@ main (gint argc, gchar *argv[])
   /* block monitor */
   block_monitor =
     block_monitor_new (config,
-                       upstream_service_get_rpc (upstream_service),
+                       upstream_service_get_rpc (upstream_service,
+                                                 UPSTREAM_CHANNEL_MONITOR),
+                       upstream_service_get_rpc (upstream_service,
+                                                 UPSTREAM_CHANNEL_LONGPOLL),
                        block_monitor_on_block_change,
                        NULL);
 
+  /* fresh work often tells of a new block before the monitor does */
+  upstream_service_watch_tip (upstream_service, upstream_service_on_tip, NULL);
+
   /* pool server */
   pool_server = pool_server_new (config,
                                  pool_server_on_getwork,
                                  pool_server_on_putwork,
                                  NULL);
 
+  /* stratum server, only if configured */
+  if (g_key_file_has_group (config, "stratum-server"))
+    {
+      stratum_server = stratum_server_new (config,
+                                           stratum_server_on_submit,
+                                           NULL);
+
+      if (! upstream_service_watch_templates (upstream_service,
+                                              upstream_service_on_template,
+                                              NULL,
+                                              &error))
+        {
+          g_print ("ERROR creating stratum server: %s\n", error->message);
+          goto out;
+        }
+    }
+
   /* work validator */
-  work_validator = work_validator_new (upstream_service_get_rpc (upstream_service));
+  work_validator = work_validator_new (config,
+                                       work_validator_on_verdict,
+                                       NULL,
+                                       &error);
+  if (work_validator == NULL)
+    {
+      g_print ("ERROR creating work validator: %s\n", error->message);
+      goto out;
+    }
   work_validator_set_target (work_validator, EASY_TARGET);
 
   /* event dispatcher */
@@ -406,6 +558,8 @@ main (gint argc, gchar *argv[])
 
   block_monitor_start (block_monitor);
   pool_server_start (pool_server);
+  if (stratum_server != NULL)
+    stratum_server_start (stratum_server);
 
   /* drop privileges */
   if (run_as_user != NULL)
@@ -435,10 +589,14 @@ main (gint argc, gchar *argv[])
   if (evd_daemon != NULL)
     g_object_unref (evd_daemon);
 
+  /* first, verdicts still pending are reported through the servers
+     and the upstream service. Then the Stratum server, which runs the
+     main loop a bit to wind its sessions down */
+  work_validator_free (work_validator);
+  stratum_server_free (stratum_server);
   upstream_service_free (upstream_service);
   block_monitor_free (block_monitor);
   pool_server_free (pool_server);
-  work_validator_free (work_validator);
   event_dispatcher_free (event_dispatcher);
   round_manager_free (round_manager);
 
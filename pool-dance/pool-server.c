@@ -32,6 +32,8 @@
 
 #define LP_PATH "/lp"
 
+#define LP_STATUS_LINE "HTTP/1.1 200 OK\r\n"
+
 struct _PoolServer
 {
   EvdWebService *web_service;
@@ -44,11 +46,35 @@ struct _PoolServer
 
   SoupMessageHeaders *headers;
 
-  GList *lp_conns;
-
-  GQueue *getwork_queue;
+  GHashTable *lp_conns;
+
+  /* long-polling response, headers and envelope included, rendered once
+     per block. Only the work data is patched in for each connection */
+  GString *lp_response;
+  gboolean lp_response_valid;
+  gsize lp_data_offset;
+  gsize lp_data_len;
+  gssize lp_midstate_offset;
+  gchar *lp_hash1;
+  gchar *lp_target;
+  guint lp_members;
+
+  /* pending getwork requests. Long-polling ones go first, the rest are
+     served round-robin across users so nobody starves when work is
+     scarce */
+  GQueue lp_queue;
+  GHashTable *user_queues;
+  GQueue user_ring;
+  guint queue_len;
 };
 
+typedef struct
+{
+  gchar *user;
+  GQueue requests;
+  GList ring_link;
+} UserQueue;
+
 struct _WorkRequest
 {
   gint ref_count;
@@ -57,6 +83,14 @@ struct _WorkRequest
   PoolServer *self;
   guint invocation_id;
   gboolean from_lp;
+
+  gchar *user;
+  gchar *passw;
+
+  /* the queue the request is waiting in, if any, and its link there */
+  GQueue *queue;
+  UserQueue *user_queue;
+  GList queue_link;
 };
 
 static void getwork_connection_on_close (EvdConnection *conn, gpointer user_data);
@@ -83,6 +117,11 @@ work_request_new (PoolServer        *self,
 
   data->from_lp = from_lp;
 
+  evd_http_request_get_basic_auth_credentials (data->req,
+                                               &data->user,
+                                               &data->passw);
+  data->queue_link.data = data;
+
   g_signal_connect (conn,
                     "close",
                     G_CALLBACK (getwork_connection_on_close),
@@ -99,6 +138,9 @@ work_request_free (WorkRequest *self)
                                         self);
   g_object_unref (self->conn);
 
+  g_free (self->user);
+  g_free (self->passw);
+
   g_slice_free (WorkRequest, self);
 }
 
@@ -140,7 +182,9 @@ work_request_get_client_info (WorkRequest  *self,
 {
   /* get user */
   if (user != NULL)
-    evd_http_request_get_basic_auth_credentials (self->req, user, password);
+    *user = g_strdup (self->user);
+  if (password != NULL)
+    *password = g_strdup (self->passw);
 
   /* get remote address */
   if (remote_addr != NULL)
@@ -159,6 +203,63 @@ work_request_get_client_info (WorkRequest  *self,
     }
 }
 
+static void
+user_queue_free (UserQueue *user_queue)
+{
+  g_free (user_queue->user);
+  g_slice_free (UserQueue, user_queue);
+}
+
+static void
+enqueue_work_request (PoolServer *self, WorkRequest *work_request)
+{
+  UserQueue *user_queue;
+  const gchar *user;
+
+  if (work_request->from_lp)
+    {
+      work_request->queue = &self->lp_queue;
+    }
+  else
+    {
+      user = work_request->user != NULL ? work_request->user : "";
+
+      user_queue = g_hash_table_lookup (self->user_queues, user);
+      if (user_queue == NULL)
+        {
+          user_queue = g_slice_new0 (UserQueue);
+          user_queue->user = g_strdup (user);
+          user_queue->ring_link.data = user_queue;
+
+          g_hash_table_insert (self->user_queues, user_queue->user, user_queue);
+          g_queue_push_tail_link (&self->user_ring, &user_queue->ring_link);
+        }
+
+      work_request->user_queue = user_queue;
+      work_request->queue = &user_queue->requests;
+    }
+
+  g_queue_push_tail_link (work_request->queue, &work_request->queue_link);
+  self->queue_len++;
+}
+
+static void
+dequeue_work_request (PoolServer *self, WorkRequest *work_request)
+{
+  UserQueue *user_queue = work_request->user_queue;
+
+  g_queue_unlink (work_request->queue, &work_request->queue_link);
+  work_request->queue = NULL;
+  work_request->user_queue = NULL;
+  self->queue_len--;
+
+  if (user_queue != NULL && user_queue->requests.length == 0)
+    {
+      g_queue_unlink (&self->user_ring, &user_queue->ring_link);
+      g_hash_table_remove (self->user_queues, user_queue->user);
+    }
+}
+
 static void
 rpc_on_method_call (EvdJsonrpcHttpServer *rpc,
                     const gchar          *method_name,
@@ -201,7 +302,7 @@ rpc_on_method_call (EvdJsonrpcHttpServer *rpc,
       getwork = work_request_new (self, invocation_id, conn, FALSE);
 
       /* enqueue getwork */
-      g_queue_push_tail (self->getwork_queue, getwork);
+      enqueue_work_request (self, getwork);
 
       /* notify of getwork request */
       self->getwork_callback (self, getwork, self->user_data);
@@ -209,14 +310,11 @@ rpc_on_method_call (EvdJsonrpcHttpServer *rpc,
   else
     {
       WorkResult *work_result;
-      JsonNode *work;
 
       /* putwork */
 
-      work = json_node_copy (params);
-
-      /* create new work result */
-      work_result = work_result_new (work, invocation_id, conn);
+      /* create new work result, decoding the submitted data */
+      work_result = work_result_new (params, invocation_id, conn);
 
       /* notify of putwork request */
       self->putwork_callback (self, work_result, self->user_data);
@@ -232,8 +330,12 @@ getwork_connection_on_close (EvdConnection *conn, gpointer user_data)
                                         getwork_connection_on_close,
                                         data);
 
-  g_queue_remove (data->self->getwork_queue, data);
-  work_request_unref (data);
+  /* requests already handed out are owned by whoever is serving them */
+  if (data->queue != NULL)
+    {
+      dequeue_work_request (data->self, data);
+      work_request_unref (data);
+    }
 }
 
 static void
@@ -244,8 +346,15 @@ lp_connection_on_close (EvdConnection *conn, gpointer user_data)
   g_signal_handlers_disconnect_by_func (conn,
                                         lp_connection_on_close,
                                         NULL);
-  self->lp_conns = g_list_remove (self->lp_conns, conn);
-  g_object_unref (conn);
+  g_hash_table_remove (self->lp_conns, conn);
+}
+
+static void
+disconnect_lp_conn (gpointer key, gpointer value, gpointer user_data)
+{
+  g_signal_handlers_disconnect_by_func (key,
+                                        lp_connection_on_close,
+                                        user_data);
 }
 
 static void
@@ -270,9 +379,8 @@ on_request_headers (EvdWebService     *service,
     {
       /* long polling request */
 
-      self->lp_conns = g_list_append (self->lp_conns, conn);
+      g_hash_table_add (self->lp_conns, g_object_ref (conn));
 
-      g_object_ref (conn);
       g_signal_connect (conn,
                         "close",
                         G_CALLBACK (lp_connection_on_close),
@@ -333,8 +441,20 @@ pool_server_new (GKeyFile            *config,
   self->listen_addr = g_strdup_printf ("%s:%u", addr, port);
   g_free (addr);
 
-  /* getwork queue */
-  self->getwork_queue = g_queue_new ();
+  /* getwork queues */
+  g_queue_init (&self->lp_queue);
+  g_queue_init (&self->user_ring);
+  self->user_queues = g_hash_table_new_full (g_str_hash,
+                                             g_str_equal,
+                                             NULL,
+                                             (GDestroyNotify) user_queue_free);
+
+  /* long-polling connections */
+  self->lp_conns = g_hash_table_new_full (g_direct_hash,
+                                          g_direct_equal,
+                                          g_object_unref,
+                                          NULL);
+  self->lp_response = g_string_new (NULL);
 
   /* JSON-RPC HTTP server */
   self->rpc = evd_jsonrpc_http_server_new ();
@@ -365,8 +485,16 @@ pool_server_free (PoolServer *self)
 
   g_free (self->listen_addr);
 
-  g_queue_free_full (self->getwork_queue, (GDestroyNotify) work_request_unref);
-  g_list_free (self->lp_conns);
+  while (self->queue_len > 0)
+    work_request_unref (pool_server_get_work_request (self));
+  g_hash_table_unref (self->user_queues);
+
+  g_hash_table_foreach (self->lp_conns, disconnect_lp_conn, self);
+  g_hash_table_unref (self->lp_conns);
+
+  g_string_free (self->lp_response, TRUE);
+  g_free (self->lp_hash1);
+  g_free (self->lp_target);
 
   g_object_unref (self->rpc);
   g_object_unref (self->web_service);
@@ -391,19 +519,163 @@ pool_server_get_web_service (PoolServer *self)
 }
 
 static void
-long_polling_conn_to_getwork (EvdHttpConnection *conn, PoolServer *self)
+long_polling_conn_to_getwork (gpointer key,
+                              gpointer value,
+                              gpointer user_data)
 {
-  WorkRequest *data;
+  EvdHttpConnection *conn = key;
+  PoolServer *self = user_data;
 
   g_signal_handlers_disconnect_by_func (conn,
                                         lp_connection_on_close,
                                         self);
 
-  data = work_request_new (self, 0, conn, TRUE);
+  enqueue_work_request (self, work_request_new (self, 0, conn, TRUE));
+}
 
-  g_object_unref (conn);
+static void
+append_lp_header (const gchar *name, const gchar *value, gpointer user_data)
+{
+  GString *response = user_data;
 
-  g_queue_push_tail (self->getwork_queue, data);
+  /* these are set from the rendered body */
+  if (g_ascii_strcasecmp (name, "Content-Length") == 0 ||
+      g_ascii_strcasecmp (name, "Content-Type") == 0 ||
+      g_ascii_strcasecmp (name, "Connection") == 0 ||
+      g_ascii_strcasecmp (name, "Transfer-Encoding") == 0)
+    {
+      return;
+    }
+
+  g_string_append_printf (response, "%s: %s\r\n", name, value);
+}
+
+static gboolean
+lp_response_fits (PoolServer *self, JsonObject *work)
+{
+  const gchar *midstate;
+
+  if (! self->lp_response_valid ||
+      json_object_get_size (work) != self->lp_members ||
+      strlen (json_object_get_string_member (work, "data")) !=
+      self->lp_data_len ||
+      g_strcmp0 (json_object_get_string_member (work, "hash1"),
+                 self->lp_hash1) != 0 ||
+      g_strcmp0 (json_object_get_string_member (work, "target"),
+                 self->lp_target) != 0)
+    {
+      return FALSE;
+    }
+
+  midstate = json_object_has_member (work, "midstate") ?
+    json_object_get_string_member (work, "midstate") : NULL;
+
+  if (midstate == NULL)
+    return self->lp_midstate_offset < 0;
+  else
+    return self->lp_midstate_offset >= 0 && strlen (midstate) == 64;
+}
+
+static void
+render_lp_response (PoolServer *self, JsonNode *work_item)
+{
+  JsonObject *work;
+  JsonGenerator *gen;
+  gchar *json;
+  gchar *body;
+  gsize body_len;
+  const gchar *data;
+  const gchar *pos;
+
+  work = json_node_get_object (work_item);
+
+  gen = json_generator_new ();
+  json_generator_set_root (gen, work_item);
+  json = json_generator_to_data (gen, NULL);
+  g_object_unref (gen);
+
+  body = g_strdup_printf ("{\"result\": %s, \"id\": \"0\", \"error\": null}",
+                          json);
+  g_free (json);
+  body_len = strlen (body);
+
+  g_string_assign (self->lp_response, LP_STATUS_LINE);
+  soup_message_headers_foreach (self->headers,
+                                append_lp_header,
+                                self->lp_response);
+  g_string_append_printf (self->lp_response,
+                          "Content-Type: application/json\r\n"
+                          "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                          "Connection: close\r\n"
+                          "\r\n",
+                          body_len);
+
+  /* hex strings need no escaping, so they show up verbatim */
+  data = json_object_get_string_member (work, "data");
+  pos = strstr (body, data);
+  self->lp_data_offset = self->lp_response->len + (pos - body);
+  self->lp_data_len = strlen (data);
+
+  self->lp_midstate_offset = -1;
+  if (json_object_has_member (work, "midstate"))
+    {
+      pos = strstr (body, json_object_get_string_member (work, "midstate"));
+      self->lp_midstate_offset = self->lp_response->len + (pos - body);
+    }
+
+  g_string_append_len (self->lp_response, body, body_len);
+  g_free (body);
+
+  g_free (self->lp_hash1);
+  self->lp_hash1 = g_strdup (json_object_get_string_member (work, "hash1"));
+  g_free (self->lp_target);
+  self->lp_target = g_strdup (json_object_get_string_member (work, "target"));
+  self->lp_members = json_object_get_size (work);
+
+  self->lp_response_valid = TRUE;
+}
+
+static gboolean
+send_lp_response (PoolServer         *self,
+                  EvdHttpConnection  *conn,
+                  JsonNode           *work_item,
+                  GError            **error)
+{
+  JsonObject *work;
+  GOutputStream *stream;
+
+  work = json_node_get_object (work_item);
+
+  if (! lp_response_fits (self, work))
+    {
+      render_lp_response (self, work_item);
+    }
+  else
+    {
+      memcpy (self->lp_response->str + self->lp_data_offset,
+              json_object_get_string_member (work, "data"),
+              self->lp_data_len);
+
+      if (self->lp_midstate_offset >= 0)
+        memcpy (self->lp_response->str + self->lp_midstate_offset,
+                json_object_get_string_member (work, "midstate"),
+                64);
+    }
+
+  /* headers and body go out in a single write */
+  stream = g_io_stream_get_output_stream (G_IO_STREAM (conn));
+  if (! g_output_stream_write_all (stream,
+                                   self->lp_response->str,
+                                   self->lp_response->len,
+                                   NULL,
+                                   NULL,
+                                   error))
+    {
+      return FALSE;
+    }
+
+  /* miners open a new long-polling request after each response */
+  return evd_connection_flush_and_shutdown (EVD_CONNECTION (conn), error);
 }
 
 void
@@ -415,22 +687,62 @@ pool_server_notify_new_block (PoolServer *self, guint block)
   soup_message_headers_replace (self->headers, "X-Blocknum", block_st);
   g_free (block_st);
 
+  /* the block number is part of the long-polling response headers */
+  self->lp_response_valid = FALSE;
+
   /* flush getwork cache */
-  g_list_foreach (self->lp_conns, (GFunc) long_polling_conn_to_getwork, self);
-  g_list_free (self->lp_conns);
-  self->lp_conns = NULL;
+  g_hash_table_foreach (self->lp_conns, long_polling_conn_to_getwork, self);
+  g_hash_table_remove_all (self->lp_conns);
 }
 
 gboolean
 pool_server_need_work (PoolServer *self)
 {
-  return g_queue_get_length (self->getwork_queue) > 0;
+  return self->queue_len > 0;
+}
+
+guint
+pool_server_get_pending_requests (PoolServer *self)
+{
+  return self->queue_len;
+}
+
+guint
+pool_server_get_pending_lp_requests (PoolServer *self)
+{
+  return self->lp_queue.length;
 }
 
 WorkRequest *
 pool_server_get_work_request (PoolServer *self)
 {
-  return g_queue_pop_head (self->getwork_queue);
+  WorkRequest *work_request;
+  UserQueue *user_queue;
+
+  if (self->lp_queue.head != NULL)
+    {
+      work_request = self->lp_queue.head->data;
+    }
+  else if (self->user_ring.head != NULL)
+    {
+      user_queue = self->user_ring.head->data;
+      work_request = user_queue->requests.head->data;
+
+      /* the user goes to the back of the ring */
+      if (user_queue->requests.length > 1)
+        {
+          g_queue_unlink (&self->user_ring, &user_queue->ring_link);
+          g_queue_push_tail_link (&self->user_ring, &user_queue->ring_link);
+        }
+    }
+  else
+    {
+      return NULL;
+    }
+
+  dequeue_work_request (self, work_request);
+
+  return work_request;
 }
 
 gboolean
@@ -456,34 +768,13 @@ pool_server_send_work_item (PoolServer  *self,
     }
   else
     {
-      JsonGenerator *gen;
-      gchar *json;
-      gchar *msg;
-
-      gen = json_generator_new ();
-      json_generator_set_root (gen, work_item);
-
-      json = json_generator_to_data (gen, NULL);
-      g_object_unref (gen);
-
-      msg = g_strdup_printf ("{\"result\": %s, \"id\": \"0\", \"error\": null}", json);
-      g_free (json);
-
-      if (! evd_web_service_respond (self->web_service,
-                                     work_request->conn,
-                                     SOUP_STATUS_OK,
-                                     self->headers,
-                                     msg,
-                                     strlen (msg),
-                                     &error))
+      if (! send_lp_response (self, work_request->conn, work_item, &error))
         {
           g_print ("Failed to send work to long-polling: %s\n", error->message);
           g_error_free (error);
 
           result = FALSE;
         }
-
-      g_free (msg);
     }
 
   return result;
@@ -41,28 +41,30 @@ typedef void (* PoolServerPutworkCb) (PoolServer *self,
                                       WorkResult *work_result,
                                       gpointer    user_data);
 
-PoolServer *    pool_server_new              (GKeyFile            *config,
-                                              PoolServerGetworkCb  getwork_callback,
-                                              PoolServerPutworkCb  putwork_callback,
-                                              gpointer             user_data);
-void            pool_server_free             (PoolServer *self);
+PoolServer *    pool_server_new                     (GKeyFile            *config,
+                                                     PoolServerGetworkCb  getwork_callback,
+                                                     PoolServerPutworkCb  putwork_callback,
+                                                     gpointer             user_data);
+void            pool_server_free                    (PoolServer *self);
 
-void            pool_server_start            (PoolServer *self);
+void            pool_server_start                   (PoolServer *self);
 
-EvdWebService * pool_server_get_web_service  (PoolServer *self);
+EvdWebService * pool_server_get_web_service         (PoolServer *self);
 
-void            pool_server_notify_new_block (PoolServer *self, guint block);
+void            pool_server_notify_new_block        (PoolServer *self, guint block);
 
-gboolean        pool_server_need_work        (PoolServer *self);
-WorkRequest *   pool_server_get_work_request (PoolServer *self);
-gboolean        pool_server_send_work_item   (PoolServer  *self,
-                                              WorkRequest *work_request,
-                                              JsonNode    *work_item);
+gboolean        pool_server_need_work               (PoolServer *self);
+guint           pool_server_get_pending_requests    (PoolServer *self);
+guint           pool_server_get_pending_lp_requests (PoolServer *self);
+WorkRequest *   pool_server_get_work_request        (PoolServer *self);
+gboolean        pool_server_send_work_item          (PoolServer  *self,
+                                                     WorkRequest *work_request,
+                                                     JsonNode    *work_item);
 
-void            pool_server_respond_putwork  (PoolServer  *self,
-                                              WorkResult  *work_result,
-                                              gboolean     accepted,
-                                              const gchar *reason);
+void            pool_server_respond_putwork         (PoolServer  *self,
+                                                     WorkResult  *work_result,
+                                                     gboolean     accepted,
+                                                     const gchar *reason);
 
 G_END_DECLS
 
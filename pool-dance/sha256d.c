@@ -0,0 +1,585 @@
+/*
+ * sha256d.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include <string.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#if defined (__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define HAVE_X86_INTRINSICS 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif
+
+#include "sha256d.h"
+
+#define HEADER_SIZE 80
+
+/* headers hashed side by side by the multi-buffer kernel */
+#define LANES 8
+
+typedef void (* Sha256TransformFunc) (guint32      *state,
+                                      const guint8 *data,
+                                      gsize         blocks);
+typedef void (* Sha256MultiHeaderFunc) (const guint32 * const *midstates,
+                                        const guint8  * const *headers,
+                                        guint8              **hashes);
+
+static const guint32 K[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+static const guint32 H0[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+static void transform_generic (guint32      *state,
+                               const guint8 *data,
+                               gsize         blocks);
+
+static Sha256TransformFunc transform = transform_generic;
+static Sha256MultiHeaderFunc multi_header = NULL;
+static const gchar *implementation_name = "generic";
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+#define SIGMA0(x) (ROTR (x, 2) ^ ROTR (x, 13) ^ ROTR (x, 22))
+#define SIGMA1(x) (ROTR (x, 6) ^ ROTR (x, 11) ^ ROTR (x, 25))
+#define sigma0(x) (ROTR (x, 7) ^ ROTR (x, 18) ^ ((x) >> 3))
+#define sigma1(x) (ROTR (x, 17) ^ ROTR (x, 19) ^ ((x) >> 10))
+
+static guint32
+read_uint32_be (const guint8 *buf)
+{
+  return ((guint32) buf[0] << 24) | ((guint32) buf[1] << 16) |
+    ((guint32) buf[2] << 8) | buf[3];
+}
+
+static void
+write_uint32_be (guint8 *buf, guint32 value)
+{
+  buf[0] = value >> 24;
+  buf[1] = (value >> 16) & 0xFF;
+  buf[2] = (value >> 8) & 0xFF;
+  buf[3] = value & 0xFF;
+}
+
+static void
+transform_generic (guint32 *state, const guint8 *data, gsize blocks)
+{
+  guint32 w[64];
+  guint32 a, b, c, d, e, f, g, h;
+  guint32 t1, t2;
+  gint i;
+
+  while (blocks-- > 0)
+    {
+      for (i=0; i<16; i++)
+        w[i] = read_uint32_be (data + i * 4);
+
+      for (i=16; i<64; i++)
+        w[i] = sigma1 (w[i - 2]) + w[i - 7] + sigma0 (w[i - 15]) + w[i - 16];
+
+      a = state[0];
+      b = state[1];
+      c = state[2];
+      d = state[3];
+      e = state[4];
+      f = state[5];
+      g = state[6];
+      h = state[7];
+
+      for (i=0; i<64; i++)
+        {
+          t1 = h + SIGMA1 (e) + CH (e, f, g) + K[i] + w[i];
+          t2 = SIGMA0 (a) + MAJ (a, b, c);
+
+          h = g;
+          g = f;
+          f = e;
+          e = d + t1;
+          d = c;
+          c = b;
+          b = a;
+          a = t1 + t2;
+        }
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+
+      data += 64;
+    }
+}
+
+#ifdef HAVE_X86_INTRINSICS
+
+/* four rounds, expanding the message schedule in place: 'w0' holds the
+   words of four rounds ago and is replaced with the current ones */
+#define SHA_NI_ROUNDS(i, w0, w1, w2, w3)                                \
+  G_STMT_START {                                                        \
+    __m128i msg;                                                        \
+                                                                        \
+    if (i >= 4)                                                         \
+      {                                                                 \
+        msg = _mm_sha256msg1_epu32 (w0, w1);                            \
+        msg = _mm_add_epi32 (msg, _mm_alignr_epi8 (w3, w2, 4));         \
+        w0 = _mm_sha256msg2_epu32 (msg, w3);                            \
+      }                                                                 \
+                                                                        \
+    msg = _mm_add_epi32 (w0, _mm_loadu_si128 ((const __m128i *) &K[(i) * 4])); \
+    state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);               \
+    msg = _mm_shuffle_epi32 (msg, 0x0E);                                \
+    state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);               \
+  } G_STMT_END
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+transform_sha_ni (guint32 *state, const guint8 *data, gsize blocks)
+{
+  const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i state0;
+  __m128i state1;
+  __m128i abef;
+  __m128i cdgh;
+  __m128i tmp;
+  __m128i w0, w1, w2, w3;
+  gint i;
+
+  /* the instructions want the state as ABEF and CDGH */
+  tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &state[0]), 0xB1);
+  state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &state[4]), 0x1B);
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);
+  state1 = _mm_blend_epi16 (state1, tmp, 0xF0);
+
+  while (blocks-- > 0)
+    {
+      abef = state0;
+      cdgh = state1;
+
+      w0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 0)), mask);
+      w1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16)), mask);
+      w2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 32)), mask);
+      w3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 48)), mask);
+
+      for (i=0; i<16; i+=4)
+        {
+          SHA_NI_ROUNDS (i, w0, w1, w2, w3);
+          SHA_NI_ROUNDS (i + 1, w1, w2, w3, w0);
+          SHA_NI_ROUNDS (i + 2, w2, w3, w0, w1);
+          SHA_NI_ROUNDS (i + 3, w3, w0, w1, w2);
+        }
+
+      state0 = _mm_add_epi32 (state0, abef);
+      state1 = _mm_add_epi32 (state1, cdgh);
+
+      data += 64;
+    }
+
+  /* back to ABCD and EFGH */
+  tmp = _mm_shuffle_epi32 (state0, 0x1B);
+  state1 = _mm_shuffle_epi32 (state1, 0xB1);
+  state0 = _mm_blend_epi16 (tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+  _mm_storeu_si128 ((__m128i *) &state[0], state0);
+  _mm_storeu_si128 ((__m128i *) &state[4], state1);
+}
+
+static gboolean
+cpu_has_sha_ni (void)
+{
+  guint eax, ebx, ecx, edx;
+
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx) ||
+      (ecx & bit_SSE4_1) == 0 ||
+      (ecx & bit_SSSE3) == 0)
+    {
+      return FALSE;
+    }
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+  /* SHA extensions */
+  return (ebx & (1 << 29)) != 0;
+}
+
+/* 8-way SHA-256 over AVX2 registers, one header per 32 bits lane */
+
+#define V_ROTR(x, n) _mm256_or_si256 (_mm256_srli_epi32 (x, n),         \
+                                      _mm256_slli_epi32 (x, 32 - (n)))
+#define V_XOR3(x, y, z) _mm256_xor_si256 (_mm256_xor_si256 (x, y), z)
+
+#define V_CH(x, y, z)  _mm256_xor_si256 (_mm256_and_si256 (x, y),        \
+                                         _mm256_andnot_si256 (x, z))
+#define V_MAJ(x, y, z) _mm256_or_si256 (_mm256_and_si256 (x, y),         \
+                                        _mm256_and_si256 (z,             \
+                                                          _mm256_or_si256 (x, y)))
+
+#define V_SIGMA0(x) V_XOR3 (V_ROTR (x, 2), V_ROTR (x, 13), V_ROTR (x, 22))
+#define V_SIGMA1(x) V_XOR3 (V_ROTR (x, 6), V_ROTR (x, 11), V_ROTR (x, 25))
+#define V_sigma0(x) V_XOR3 (V_ROTR (x, 7), V_ROTR (x, 18), _mm256_srli_epi32 (x, 3))
+#define V_sigma1(x) V_XOR3 (V_ROTR (x, 17), V_ROTR (x, 19), _mm256_srli_epi32 (x, 10))
+
+__attribute__ ((target ("avx2")))
+static void
+transform_avx2 (__m256i *state, __m256i *w)
+{
+  __m256i a, b, c, d, e, f, g, h;
+  __m256i t1, t2;
+  gint i;
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  f = state[5];
+  g = state[6];
+  h = state[7];
+
+  for (i=0; i<64; i++)
+    {
+      /* the message schedule is kept in a ring of 16 words */
+      if (i >= 16)
+        w[i & 15] = _mm256_add_epi32 (_mm256_add_epi32 (w[i & 15],
+                                                        V_sigma0 (w[(i + 1) & 15])),
+                                      _mm256_add_epi32 (w[(i + 9) & 15],
+                                                        V_sigma1 (w[(i + 14) & 15])));
+
+      t1 = _mm256_add_epi32 (_mm256_add_epi32 (h, V_SIGMA1 (e)),
+                             _mm256_add_epi32 (V_CH (e, f, g),
+                                               _mm256_add_epi32 (_mm256_set1_epi32 (K[i]),
+                                                                 w[i & 15])));
+      t2 = _mm256_add_epi32 (V_SIGMA0 (a), V_MAJ (a, b, c));
+
+      h = g;
+      g = f;
+      f = e;
+      e = _mm256_add_epi32 (d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = _mm256_add_epi32 (t1, t2);
+    }
+
+  state[0] = _mm256_add_epi32 (state[0], a);
+  state[1] = _mm256_add_epi32 (state[1], b);
+  state[2] = _mm256_add_epi32 (state[2], c);
+  state[3] = _mm256_add_epi32 (state[3], d);
+  state[4] = _mm256_add_epi32 (state[4], e);
+  state[5] = _mm256_add_epi32 (state[5], f);
+  state[6] = _mm256_add_epi32 (state[6], g);
+  state[7] = _mm256_add_epi32 (state[7], h);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+multi_header_avx2 (const guint32 * const *midstates,
+                   const guint8  * const *headers,
+                   guint8              **hashes)
+{
+  __m256i state[8];
+  __m256i w[16];
+  guint32 lane[LANES];
+  gint i;
+  gint j;
+
+  for (i=0; i<8; i++)
+    {
+      for (j=0; j<LANES; j++)
+        lane[j] = midstates[j][i];
+      state[i] = _mm256_loadu_si256 ((const __m256i *) lane);
+    }
+
+  /* second block of the header: its last 16 bytes plus fixed padding */
+  for (i=0; i<4; i++)
+    {
+      for (j=0; j<LANES; j++)
+        lane[j] = read_uint32_be (headers[j] + 64 + i * 4);
+      w[i] = _mm256_loadu_si256 ((const __m256i *) lane);
+    }
+  w[4] = _mm256_set1_epi32 (0x80000000);
+  for (i=5; i<15; i++)
+    w[i] = _mm256_setzero_si256 ();
+  w[15] = _mm256_set1_epi32 (HEADER_SIZE * 8);
+
+  transform_avx2 (state, w);
+
+  /* second pass over the 32 bytes digests */
+  for (i=0; i<8; i++)
+    {
+      w[i] = state[i];
+      state[i] = _mm256_set1_epi32 (H0[i]);
+    }
+  w[8] = _mm256_set1_epi32 (0x80000000);
+  for (i=9; i<15; i++)
+    w[i] = _mm256_setzero_si256 ();
+  w[15] = _mm256_set1_epi32 (32 * 8);
+
+  transform_avx2 (state, w);
+
+  for (i=0; i<8; i++)
+    {
+      _mm256_storeu_si256 ((__m256i *) lane, state[i]);
+      for (j=0; j<LANES; j++)
+        write_uint32_be (hashes[j] + i * 4, lane[j]);
+    }
+}
+
+static gboolean
+cpu_has_avx2 (void)
+{
+  guint eax, ebx, ecx, edx;
+
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx) ||
+      (ecx & bit_OSXSAVE) == 0 ||
+      (ecx & bit_AVX) == 0)
+    {
+      return FALSE;
+    }
+
+  /* the OS must preserve the YMM registers */
+  __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  if ((eax & 0x6) != 0x6)
+    return FALSE;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+  return (ebx & bit_AVX2) != 0;
+}
+
+#endif /* HAVE_X86_INTRINSICS */
+
+static void
+state_to_hash (const guint32 *state, guint8 *hash)
+{
+  gint i;
+
+  for (i=0; i<8; i++)
+    write_uint32_be (hash + i * 4, state[i]);
+}
+
+static void
+sha256 (const guint8 *data, gsize size, guint8 *hash)
+{
+  guint32 state[8];
+  guint8 block[128] = {0, };
+  gsize full_blocks;
+  gsize rest;
+  gsize pad_blocks;
+  guint64 bits;
+
+  memcpy (state, H0, sizeof (state));
+
+  full_blocks = size / 64;
+  transform (state, data, full_blocks);
+
+  rest = size - full_blocks * 64;
+  memcpy (block, data + full_blocks * 64, rest);
+  block[rest] = 0x80;
+
+  pad_blocks = rest < 56 ? 1 : 2;
+  bits = (guint64) size * 8;
+  write_uint32_be (block + pad_blocks * 64 - 8, bits >> 32);
+  write_uint32_be (block + pad_blocks * 64 - 4, bits & 0xFFFFFFFF);
+
+  transform (state, block, pad_blocks);
+
+  state_to_hash (state, hash);
+}
+
+/* public methods */
+
+void
+sha256d_init (void)
+{
+  sha256d_init_with_features (SHA256D_FEATURE_ALL);
+}
+
+/* enables the kernels allowed by 'features' that the CPU supports, and
+   returns the features actually enabled */
+guint
+sha256d_init_with_features (guint features)
+{
+  guint enabled = 0;
+
+  transform = transform_generic;
+  multi_header = NULL;
+  implementation_name = "generic";
+
+#ifdef HAVE_X86_INTRINSICS
+  if ((features & SHA256D_FEATURE_SHA_NI) != 0 && cpu_has_sha_ni ())
+    {
+      transform = transform_sha_ni;
+      implementation_name = "sha-ni";
+      enabled |= SHA256D_FEATURE_SHA_NI;
+    }
+
+  /* even next to SHA-NI, eight lanes at once win for batches */
+  if ((features & SHA256D_FEATURE_AVX2) != 0 && cpu_has_avx2 ())
+    {
+      multi_header = multi_header_avx2;
+      implementation_name = transform == transform_sha_ni ?
+        "sha-ni, avx2 x8" : "generic, avx2 x8";
+      enabled |= SHA256D_FEATURE_AVX2;
+    }
+#endif
+
+  return enabled;
+}
+
+const gchar *
+sha256d_get_implementation_name (void)
+{
+  return implementation_name;
+}
+
+void
+sha256d_hash (const guint8 *data, gsize size, guint8 *hash)
+{
+  sha256 (data, size, hash);
+  sha256 (hash, 32, hash);
+}
+
+/* block headers have a fixed size, so the padding is known in advance */
+void
+sha256d_hash_header (const guint8 *header, guint8 *hash)
+{
+  guint32 midstate[8];
+
+  sha256d_midstate (header, midstate);
+  sha256d_hash_header_from_midstate (midstate, header, hash);
+}
+
+/* state after the first 64 bytes of a header, which all the shares of
+   the same work item have in common */
+void
+sha256d_midstate (const guint8 *block, guint32 *midstate)
+{
+  memcpy (midstate, H0, sizeof (H0));
+  transform (midstate, block, 1);
+}
+
+void
+sha256d_hash_header_from_midstate (const guint32 *midstate,
+                                   const guint8  *header,
+                                   guint8        *hash)
+{
+  guint32 state[8];
+  guint8 block[64] = {0, };
+
+  memcpy (state, midstate, sizeof (state));
+
+  memcpy (block, header + 64, HEADER_SIZE - 64);
+  block[HEADER_SIZE - 64] = 0x80;
+  write_uint32_be (block + 60, HEADER_SIZE * 8);
+  transform (state, block, 1);
+
+  /* second pass over the 32 bytes digest */
+  memset (block, 0, sizeof (block));
+  state_to_hash (state, block);
+  block[32] = 0x80;
+  write_uint32_be (block + 60, 32 * 8);
+
+  memcpy (state, H0, sizeof (state));
+  transform (state, block, 1);
+
+  state_to_hash (state, hash);
+}
+
+/* hashes 'count' headers whose first block is already folded into the
+   given midstates, several at a time when the CPU allows it */
+void
+sha256d_hash_headers_from_midstates (const guint32 * const *midstates,
+                                     const guint8  * const *headers,
+                                     guint8              **hashes,
+                                     guint                 count)
+{
+  guint i = 0;
+
+  if (multi_header != NULL)
+    {
+      const guint32 *lane_midstates[LANES];
+      const guint8 *lane_headers[LANES];
+      guint8 *lane_hashes[LANES];
+      guint8 spare_hashes[LANES][32];
+      guint rest;
+      guint j;
+
+      for (; i + LANES <= count; i += LANES)
+        multi_header (midstates + i, headers + i, hashes + i);
+
+      /* a partial group is still worth it if at least half full, the
+         spare lanes just repeat its first header */
+      rest = count - i;
+      if (rest >= LANES / 2)
+        {
+          for (j=0; j<LANES; j++)
+            {
+              lane_midstates[j] = midstates[i + (j < rest ? j : 0)];
+              lane_headers[j] = headers[i + (j < rest ? j : 0)];
+              lane_hashes[j] = j < rest ? hashes[i + j] : spare_hashes[j];
+            }
+
+          multi_header (lane_midstates, lane_headers, lane_hashes);
+          i = count;
+        }
+    }
+
+  for (; i < count; i++)
+    sha256d_hash_header_from_midstate (midstates[i], headers[i], hashes[i]);
+}
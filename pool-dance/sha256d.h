@@ -0,0 +1,61 @@
+/*
+ * sha256d.h
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#ifndef __SHA256D_H__
+#define __SHA256D_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  SHA256D_FEATURE_SHA_NI = 1 << 0,
+  SHA256D_FEATURE_AVX2   = 1 << 1,
+
+  SHA256D_FEATURE_ALL    = (1 << 2) - 1
+} Sha256dFeatures;
+
+void            sha256d_init                        (void);
+guint           sha256d_init_with_features          (guint features);
+const gchar *   sha256d_get_implementation_name     (void);
+
+void            sha256d_hash                        (const guint8 *data,
+                                                     gsize         size,
+                                                     guint8       *hash);
+void            sha256d_hash_header                 (const guint8 *header,
+                                                     guint8       *hash);
+
+void            sha256d_midstate                    (const guint8 *block,
+                                                     guint32      *midstate);
+void            sha256d_hash_header_from_midstate   (const guint32 *midstate,
+                                                     const guint8  *header,
+                                                     guint8        *hash);
+void            sha256d_hash_headers_from_midstates (const guint32 * const *midstates,
+                                                     const guint8  * const *headers,
+                                                     guint8              **hashes,
+                                                     guint                 count);
+
+G_END_DECLS
+
+#endif /* __SHA256D_H__ */
@@ -0,0 +1,888 @@
+/*
+ * stratum-server.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include <string.h>
+
+#include "stratum-server.h"
+
+#include "hex-codec.h"
+
+#define CONFIG_GROUP_NAME "stratum-server"
+
+#define DEFAULT_LISTEN_ADDR "0.0.0.0"
+#define DEFAULT_LISTEN_PORT 3333
+
+/* also the size of a session's read buffer, a line that does not fit
+   in it closes the session */
+#define MAX_LINE_LENGTH 4096
+
+/* same as the easy target served to getwork miners */
+#define SHARE_DIFFICULTY "1"
+
+typedef enum
+{
+  STRATUM_ERROR_OTHER          = 20,
+  STRATUM_ERROR_JOB_NOT_FOUND  = 21,
+  STRATUM_ERROR_UNAUTHORIZED   = 24,
+  STRATUM_ERROR_NOT_SUBSCRIBED = 25
+} StratumError;
+
+struct _StratumServer
+{
+  EvdService *service;
+  gchar *listen_addr;
+
+  StratumServerSubmitCb submit_callback;
+  gpointer user_data;
+
+  GHashTable *sessions;
+  guint32 extranonce1_count;
+  guint pending_reads;
+
+  GHashTable *jobs;
+  GHashTable *jobs_prev;
+  guint job_count;
+  gchar *notify_msg;
+
+  GHashTable *invocations;
+  guint invocation_count;
+};
+
+typedef struct
+{
+  gint ref_count;
+  StratumServer *self;
+  EvdConnection *conn;
+  GDataInputStream *input;
+  GCancellable *cancellable;
+
+  guint8 extranonce1[BLOCK_TEMPLATE_EXTRANONCE1_SIZE];
+
+  gchar *user;
+  gchar *passw;
+  gchar *user_agent;
+
+  gboolean subscribed;
+  gboolean closed;
+} StratumSession;
+
+typedef struct
+{
+  StratumSession *session;
+  JsonNode *id;
+} StratumInvocation;
+
+static void session_read_line (StratumSession *session);
+
+static StratumSession *
+stratum_session_ref (StratumSession *session)
+{
+  session->ref_count++;
+
+  return session;
+}
+
+static void
+stratum_session_unref (StratumSession *session)
+{
+  session->ref_count--;
+  if (session->ref_count > 0)
+    return;
+
+  g_object_unref (session->input);
+  g_object_unref (session->conn);
+  g_object_unref (session->cancellable);
+
+  g_free (session->user);
+  g_free (session->passw);
+  g_free (session->user_agent);
+
+  g_slice_free (StratumSession, session);
+}
+
+static void
+stratum_invocation_free (StratumInvocation *invocation)
+{
+  stratum_session_unref (invocation->session);
+  json_node_free (invocation->id);
+
+  g_slice_free (StratumInvocation, invocation);
+}
+
+static GHashTable *
+jobs_table_new (void)
+{
+  return g_hash_table_new_full (g_str_hash,
+                                g_str_equal,
+                                g_free,
+                                (GDestroyNotify) block_template_unref);
+}
+
+static const gchar *
+get_string_param (JsonArray *params, guint index)
+{
+  JsonNode *node;
+
+  if (index >= json_array_get_length (params))
+    return NULL;
+
+  node = json_array_get_element (params, index);
+  if (! JSON_NODE_HOLDS_VALUE (node) ||
+      json_node_get_value_type (node) != G_TYPE_STRING)
+    {
+      return NULL;
+    }
+
+  return json_node_get_string (node);
+}
+
+static gboolean
+parse_uint32_hex (const gchar *hex, guint32 *value)
+{
+  guint8 bin[4];
+
+  if (strlen (hex) != 8 || ! hex_codec_decode (hex, bin, 4))
+    return FALSE;
+
+  *value = (bin[0] << 24) | (bin[1] << 16) | (bin[2] << 8) | bin[3];
+
+  return TRUE;
+}
+
+static gchar *
+json_node_to_data (JsonNode *node)
+{
+  JsonGenerator *gen;
+  gchar *data;
+
+  if (node == NULL)
+    return g_strdup ("null");
+
+  gen = json_generator_new ();
+  json_generator_set_root (gen, node);
+
+  data = json_generator_to_data (gen, NULL);
+  g_object_unref (gen);
+
+  return data;
+}
+
+static void
+session_send (StratumSession *session, const gchar *msg)
+{
+  GOutputStream *stream;
+  GError *error = NULL;
+
+  if (session->closed)
+    return;
+
+  stream = g_io_stream_get_output_stream (G_IO_STREAM (session->conn));
+  if (! g_output_stream_write_all (stream,
+                                   msg,
+                                   strlen (msg),
+                                   NULL,
+                                   NULL,
+                                   &error))
+    {
+      g_print ("STRATUM-SERVER: Failed to send message: %s\n", error->message);
+      g_error_free (error);
+    }
+}
+
+static void
+session_respond (StratumSession *session, JsonNode *id, const gchar *result)
+{
+  gchar *id_str;
+  gchar *msg;
+
+  id_str = json_node_to_data (id);
+  msg = g_strdup_printf ("{\"id\": %s, \"result\": %s, \"error\": null}\n",
+                         id_str,
+                         result);
+  g_free (id_str);
+
+  session_send (session, msg);
+  g_free (msg);
+}
+
+static void
+session_respond_error (StratumSession *session,
+                       JsonNode       *id,
+                       StratumError    code,
+                       const gchar    *message)
+{
+  gchar *id_str;
+  gchar *msg;
+
+  id_str = json_node_to_data (id);
+  msg = g_strdup_printf ("{\"id\": %s, \"result\": null, \"error\": [%d, \"%s\", null]}\n",
+                         id_str,
+                         code,
+                         message);
+  g_free (id_str);
+
+  session_send (session, msg);
+  g_free (msg);
+}
+
+static void
+connection_on_close (EvdConnection *conn, gpointer user_data)
+{
+  StratumSession *session = user_data;
+
+  g_signal_handlers_disconnect_by_func (conn,
+                                        connection_on_close,
+                                        session);
+
+  session->closed = TRUE;
+  g_hash_table_remove (session->self->sessions, conn);
+}
+
+static void
+session_close (StratumSession *session)
+{
+  if (session->closed)
+    return;
+
+  g_io_stream_close (G_IO_STREAM (session->conn), NULL, NULL);
+
+  if (! session->closed)
+    connection_on_close (session->conn, session);
+}
+
+static void
+session_on_subscribe (StratumSession *session,
+                      JsonNode       *id,
+                      JsonArray      *params)
+{
+  StratumServer *self = session->self;
+  gchar extranonce1[BLOCK_TEMPLATE_EXTRANONCE1_SIZE * 2 + 1];
+  gchar *result;
+
+  g_free (session->user_agent);
+  session->user_agent = g_strdup (get_string_param (params, 0));
+
+  hex_codec_encode (session->extranonce1,
+                    BLOCK_TEMPLATE_EXTRANONCE1_SIZE,
+                    extranonce1);
+
+  result = g_strdup_printf ("[[[\"mining.set_difficulty\", \"%s\"], "
+                            "[\"mining.notify\", \"%s\"]], \"%s\", %d]",
+                            extranonce1,
+                            extranonce1,
+                            extranonce1,
+                            BLOCK_TEMPLATE_EXTRANONCE2_SIZE);
+  session_respond (session, id, result);
+  g_free (result);
+
+  session->subscribed = TRUE;
+
+  session_send (session,
+                "{\"id\": null, \"method\": \"mining.set_difficulty\", "
+                "\"params\": [" SHARE_DIFFICULTY "]}\n");
+
+  if (self->notify_msg != NULL)
+    session_send (session, self->notify_msg);
+}
+
+static void
+session_on_authorize (StratumSession *session,
+                      JsonNode       *id,
+                      JsonArray      *params)
+{
+  const gchar *user;
+
+  user = get_string_param (params, 0);
+  if (user == NULL || user[0] == '\0')
+    {
+      session_respond (session, id, "false");
+      return;
+    }
+
+  g_free (session->user);
+  session->user = g_strdup (user);
+
+  g_free (session->passw);
+  session->passw = g_strdup (get_string_param (params, 1));
+
+  session_respond (session, id, "true");
+}
+
+static void
+session_on_submit (StratumSession *session,
+                   JsonNode       *id,
+                   JsonArray      *params)
+{
+  StratumServer *self = session->self;
+  const gchar *job_id;
+  const gchar *extranonce2;
+  const gchar *ntime_hex;
+  const gchar *nonce_hex;
+  BlockTemplate *block_template;
+  gboolean stale = FALSE;
+  guint8 extranonce[BLOCK_TEMPLATE_EXTRANONCE_SIZE];
+  guint32 ntime;
+  guint32 nonce;
+  guint32 curtime;
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+  WorkResult *work_result;
+  StratumInvocation *invocation;
+
+  if (! session->subscribed)
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_NOT_SUBSCRIBED,
+                             "Not subscribed");
+      return;
+    }
+
+  if (session->user == NULL ||
+      g_strcmp0 (get_string_param (params, 0), session->user) != 0)
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_UNAUTHORIZED,
+                             "Unauthorized worker");
+      return;
+    }
+
+  job_id = get_string_param (params, 1);
+  extranonce2 = get_string_param (params, 2);
+  ntime_hex = get_string_param (params, 3);
+  nonce_hex = get_string_param (params, 4);
+
+  if (job_id == NULL ||
+      extranonce2 == NULL ||
+      ntime_hex == NULL ||
+      nonce_hex == NULL)
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_OTHER,
+                             "Invalid parameters");
+      return;
+    }
+
+  /* shares for jobs of the previous block are passed on as stale */
+  block_template = g_hash_table_lookup (self->jobs, job_id);
+  if (block_template == NULL)
+    {
+      block_template = g_hash_table_lookup (self->jobs_prev, job_id);
+      stale = TRUE;
+    }
+
+  if (block_template == NULL)
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_JOB_NOT_FOUND,
+                             "Job not found");
+      return;
+    }
+
+  memcpy (extranonce, session->extranonce1, BLOCK_TEMPLATE_EXTRANONCE1_SIZE);
+
+  if (strlen (extranonce2) != BLOCK_TEMPLATE_EXTRANONCE2_SIZE * 2 ||
+      ! hex_codec_decode (extranonce2,
+                          extranonce + BLOCK_TEMPLATE_EXTRANONCE1_SIZE,
+                          BLOCK_TEMPLATE_EXTRANONCE2_SIZE) ||
+      ! parse_uint32_hex (ntime_hex, &ntime) ||
+      ! parse_uint32_hex (nonce_hex, &nonce))
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_OTHER,
+                             "Malformed share");
+      return;
+    }
+
+  curtime = block_template_get_curtime (block_template);
+  if (ntime < curtime || ntime > curtime + BLOCK_TEMPLATE_MAX_NTIME_DRIFT)
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_OTHER,
+                             "Time out of range");
+      return;
+    }
+
+  /* rebuild the header, so that it takes the same path as any other
+     work result */
+  block_template_build_header (block_template, extranonce, ntime, nonce, header);
+
+  self->invocation_count++;
+
+  work_result = work_result_new_with_client_info (header,
+                                                  self->invocation_count,
+                                                  session->conn,
+                                                  session->user,
+                                                  session->passw,
+                                                  session->user_agent);
+  work_result_set_block_template (work_result, block_template, extranonce);
+  if (stale)
+    work_result_mark_stale (work_result);
+
+  invocation = g_slice_new (StratumInvocation);
+  invocation->session = stratum_session_ref (session);
+  invocation->id = json_node_copy (id);
+  g_hash_table_insert (self->invocations,
+                       GUINT_TO_POINTER (self->invocation_count),
+                       invocation);
+
+  self->submit_callback (self, work_result, self->user_data);
+}
+
+static void
+session_handle_message (StratumSession *session,
+                        const gchar    *msg,
+                        gsize           len)
+{
+  JsonParser *parser;
+  JsonObject *obj;
+  JsonNode *id;
+  JsonNode *params;
+  JsonNode *method_node;
+  const gchar *method = NULL;
+
+  parser = json_parser_new ();
+
+  if (! json_parser_load_from_data (parser, msg, len, NULL) ||
+      ! JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser)))
+    {
+      g_object_unref (parser);
+      session_close (session);
+      return;
+    }
+
+  obj = json_node_get_object (json_parser_get_root (parser));
+
+  id = json_object_get_member (obj, "id");
+  params = json_object_get_member (obj, "params");
+
+  method_node = json_object_get_member (obj, "method");
+  if (method_node != NULL &&
+      JSON_NODE_HOLDS_VALUE (method_node) &&
+      json_node_get_value_type (method_node) == G_TYPE_STRING)
+    {
+      method = json_node_get_string (method_node);
+    }
+
+  if (id == NULL ||
+      method == NULL ||
+      params == NULL ||
+      ! JSON_NODE_HOLDS_ARRAY (params))
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_OTHER,
+                             "Invalid request");
+    }
+  else if (g_strcmp0 (method, "mining.subscribe") == 0)
+    {
+      session_on_subscribe (session, id, json_node_get_array (params));
+    }
+  else if (g_strcmp0 (method, "mining.authorize") == 0)
+    {
+      session_on_authorize (session, id, json_node_get_array (params));
+    }
+  else if (g_strcmp0 (method, "mining.submit") == 0)
+    {
+      session_on_submit (session, id, json_node_get_array (params));
+    }
+  else
+    {
+      session_respond_error (session,
+                             id,
+                             STRATUM_ERROR_OTHER,
+                             "Method not supported");
+    }
+
+  g_object_unref (parser);
+}
+
+static void
+session_on_fill (GObject      *obj,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  StratumSession *session = user_data;
+  GError *error = NULL;
+  gssize size;
+
+  size = g_buffered_input_stream_fill_finish (G_BUFFERED_INPUT_STREAM (obj),
+                                              result,
+                                              &error);
+  session->self->pending_reads--;
+
+  if (g_cancellable_is_cancelled (session->cancellable))
+    {
+      /* the server is going away */
+      if (error != NULL)
+        g_error_free (error);
+    }
+  else if (size <= 0)
+    {
+      /* connection closed or failed */
+      if (error != NULL)
+        g_error_free (error);
+
+      session_close (session);
+    }
+  else if (! session->closed)
+    {
+      session_read_line (session);
+    }
+
+  stratum_session_unref (session);
+}
+
+/* handles the lines already buffered, then waits for more data. The
+   buffer never grows, so a client can't make it hold more than a line */
+static void
+session_read_line (StratumSession *session)
+{
+  GBufferedInputStream *buffered = G_BUFFERED_INPUT_STREAM (session->input);
+  const gchar *buffer;
+  gsize available = 0;
+  gchar *line;
+  gsize len;
+
+  while (! session->closed)
+    {
+      buffer = g_buffered_input_stream_peek_buffer (buffered, &available);
+      if (memchr (buffer, '\n', available) == NULL)
+        break;
+
+      /* the newline is there, this does not block */
+      line = g_data_input_stream_read_line (session->input, &len, NULL, NULL);
+      if (line == NULL)
+        {
+          session_close (session);
+          return;
+        }
+
+      if (len > 0)
+        session_handle_message (session, line, len);
+      g_free (line);
+    }
+
+  if (session->closed)
+    return;
+
+  if (available >= MAX_LINE_LENGTH)
+    {
+      session_close (session);
+      return;
+    }
+
+  stratum_session_ref (session);
+  session->self->pending_reads++;
+
+  g_buffered_input_stream_fill_async (buffered,
+                                      -1,
+                                      G_PRIORITY_DEFAULT,
+                                      session->cancellable,
+                                      session_on_fill,
+                                      session);
+}
+
+static void
+service_on_new_connection (EvdService    *service,
+                           EvdConnection *conn,
+                           gpointer       user_data)
+{
+  StratumServer *self = user_data;
+  StratumSession *session;
+  GInputStream *stream;
+  guint32 extranonce1;
+
+  session = g_slice_new0 (StratumSession);
+  session->ref_count = 1;
+  session->self = self;
+
+  session->conn = conn;
+  g_object_ref (conn);
+  session->cancellable = g_cancellable_new ();
+
+  stream = g_io_stream_get_input_stream (G_IO_STREAM (conn));
+  session->input = g_data_input_stream_new (stream);
+  g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (session->input),
+                                               FALSE);
+  g_buffered_input_stream_set_buffer_size (G_BUFFERED_INPUT_STREAM (session->input),
+                                           MAX_LINE_LENGTH);
+  g_data_input_stream_set_newline_type (session->input,
+                                        G_DATA_STREAM_NEWLINE_TYPE_LF);
+
+  /* each session gets its own slice of the extranonce space */
+  if (self->extranonce1_count == BLOCK_TEMPLATE_LOCAL_EXTRANONCE1)
+    self->extranonce1_count++;
+  extranonce1 = self->extranonce1_count++;
+  session->extranonce1[0] = (extranonce1 >> 24) & 0xFF;
+  session->extranonce1[1] = (extranonce1 >> 16) & 0xFF;
+  session->extranonce1[2] = (extranonce1 >> 8) & 0xFF;
+  session->extranonce1[3] = extranonce1 & 0xFF;
+
+  g_hash_table_insert (self->sessions, conn, session);
+
+  g_signal_connect (conn,
+                    "close",
+                    G_CALLBACK (connection_on_close),
+                    session);
+
+  session_read_line (session);
+}
+
+static void
+service_on_listen (GObject      *obj,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  GError *error = NULL;
+
+  if (! evd_service_listen_finish (EVD_SERVICE (obj),
+                                   result,
+                                   &error))
+    {
+      g_print ("STRATUM-SERVER: %s\n", error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      g_print ("STRATUM-SERVER: Listening...\n");
+    }
+}
+
+static gchar *
+build_notify_msg (const gchar   *job_id,
+                  BlockTemplate *block_template,
+                  gboolean       clean)
+{
+  GString *msg;
+  GByteArray *coinbase;
+  const guint8 *prev_hash;
+  const guint8 *branch;
+  guint branch_len;
+  gchar hex[65];
+  gchar *coinbase_hex;
+  guint i;
+
+  msg = g_string_new ("{\"id\": null, \"method\": \"mining.notify\", \"params\": [");
+
+  /* previous block hash goes as in getwork data, with the bytes of
+     each 32 bits word swapped */
+  prev_hash = block_template_get_prev_hash (block_template);
+  hex_codec_encode_swap32 (prev_hash, 32, hex);
+
+  g_string_append_printf (msg, "\"%s\", \"%s\", ", job_id, hex);
+
+  coinbase = block_template_get_coinbase1 (block_template);
+  coinbase_hex = hex_codec_encode_dup (coinbase->data, coinbase->len);
+  g_string_append_printf (msg, "\"%s\", ", coinbase_hex);
+  g_free (coinbase_hex);
+
+  coinbase = block_template_get_coinbase2 (block_template);
+  coinbase_hex = hex_codec_encode_dup (coinbase->data, coinbase->len);
+  g_string_append_printf (msg, "\"%s\", [", coinbase_hex);
+  g_free (coinbase_hex);
+
+  branch = block_template_get_merkle_branch (block_template, &branch_len);
+  for (i=0; i<branch_len; i++)
+    {
+      hex_codec_encode (branch + i * 32, 32, hex);
+      g_string_append_printf (msg, "%s\"%s\"", i > 0 ? ", " : "", hex);
+    }
+
+  g_string_append_printf (msg,
+                          "], \"%08x\", \"%08x\", \"%08x\", %s]}\n",
+                          block_template_get_version (block_template),
+                          block_template_get_bits (block_template),
+                          block_template_get_curtime (block_template),
+                          clean ? "true" : "false");
+
+  return g_string_free (msg, FALSE);
+}
+
+/* public methods */
+
+StratumServer *
+stratum_server_new (GKeyFile              *config,
+                    StratumServerSubmitCb  submit_callback,
+                    gpointer               user_data)
+{
+  StratumServer *self;
+  gchar *addr;
+  guint port;
+
+  self = g_slice_new0 (StratumServer);
+
+  self->submit_callback = submit_callback;
+  self->user_data = user_data;
+
+  addr = g_key_file_get_string (config,
+                                CONFIG_GROUP_NAME,
+                                "listen-addr",
+                                NULL);
+  if (addr == NULL || addr[0] == '\0')
+    addr = g_strdup (DEFAULT_LISTEN_ADDR);
+
+  port = g_key_file_get_integer (config,
+                                 CONFIG_GROUP_NAME,
+                                 "listen-port",
+                                 NULL);
+  if (port == 0)
+    port = DEFAULT_LISTEN_PORT;
+
+  self->listen_addr = g_strdup_printf ("%s:%u", addr, port);
+  g_free (addr);
+
+  self->sessions =
+    g_hash_table_new_full (g_direct_hash,
+                           g_direct_equal,
+                           NULL,
+                           (GDestroyNotify) stratum_session_unref);
+  self->extranonce1_count = g_random_int ();
+
+  self->jobs = jobs_table_new ();
+  self->jobs_prev = jobs_table_new ();
+
+  self->invocations =
+    g_hash_table_new_full (g_direct_hash,
+                           g_direct_equal,
+                           NULL,
+                           (GDestroyNotify) stratum_invocation_free);
+
+  self->service = evd_service_new ();
+  g_signal_connect (self->service,
+                    "new-connection",
+                    G_CALLBACK (service_on_new_connection),
+                    self);
+
+  return self;
+}
+
+void
+stratum_server_free (StratumServer *self)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  if (self == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, self->sessions);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_signal_handlers_disconnect_by_func (key, connection_on_close, value);
+      g_cancellable_cancel (((StratumSession *) value)->cancellable);
+    }
+
+  g_hash_table_unref (self->invocations);
+  g_hash_table_unref (self->sessions);
+
+  /* cancelled reads hold the last references to their sessions, let
+     them finish while the server is still around */
+  while (self->pending_reads > 0 && g_main_context_iteration (NULL, FALSE))
+    ;
+  g_hash_table_unref (self->jobs);
+  g_hash_table_unref (self->jobs_prev);
+
+  g_free (self->notify_msg);
+  g_free (self->listen_addr);
+
+  g_object_unref (self->service);
+
+  g_slice_free (StratumServer, self);
+}
+
+void
+stratum_server_start (StratumServer *self)
+{
+  evd_service_listen (self->service,
+                      self->listen_addr,
+                      NULL,
+                      service_on_listen,
+                      self);
+}
+
+void
+stratum_server_notify_template (StratumServer *self,
+                                BlockTemplate *block_template,
+                                gboolean       clean)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gchar *job_id;
+
+  /* jobs of the previous block are kept to flag late shares as stale */
+  if (clean)
+    {
+      g_hash_table_unref (self->jobs_prev);
+      self->jobs_prev = self->jobs;
+      self->jobs = jobs_table_new ();
+    }
+
+  self->job_count++;
+  job_id = g_strdup_printf ("%x", self->job_count);
+
+  g_hash_table_insert (self->jobs, job_id, block_template_ref (block_template));
+
+  g_free (self->notify_msg);
+  self->notify_msg = build_notify_msg (job_id, block_template, clean);
+
+  g_hash_table_iter_init (&iter, self->sessions);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      StratumSession *session = value;
+
+      if (session->subscribed)
+        session_send (session, self->notify_msg);
+    }
+}
+
+void
+stratum_server_respond_submit (StratumServer *self,
+                               WorkResult    *work_result,
+                               gboolean       accepted,
+                               const gchar   *reason)
+{
+  StratumInvocation *invocation;
+  gpointer invocation_id;
+
+  invocation_id = GUINT_TO_POINTER (work_result_get_invocation_id (work_result));
+
+  invocation = g_hash_table_lookup (self->invocations, invocation_id);
+  if (invocation == NULL)
+    return;
+
+  if (accepted)
+    session_respond (invocation->session, invocation->id, "true");
+  else
+    session_respond_error (invocation->session,
+                           invocation->id,
+                           STRATUM_ERROR_OTHER,
+                           reason);
+
+  g_hash_table_remove (self->invocations, invocation_id);
+}
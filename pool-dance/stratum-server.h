@@ -0,0 +1,58 @@
+/*
+ * stratum-server.h
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#ifndef __STRATUM_SERVER_H__
+#define __STRATUM_SERVER_H__
+
+#include <evd.h>
+
+#include "work-result.h"
+#include "block-template.h"
+
+G_BEGIN_DECLS
+
+typedef struct _StratumServer StratumServer;
+
+typedef void (* StratumServerSubmitCb) (StratumServer *self,
+                                        WorkResult    *work_result,
+                                        gpointer       user_data);
+
+StratumServer * stratum_server_new             (GKeyFile              *config,
+                                                StratumServerSubmitCb  submit_callback,
+                                                gpointer               user_data);
+void            stratum_server_free            (StratumServer *self);
+
+void            stratum_server_start           (StratumServer *self);
+
+void            stratum_server_notify_template (StratumServer *self,
+                                                BlockTemplate *block_template,
+                                                gboolean       clean);
+
+void            stratum_server_respond_submit  (StratumServer *self,
+                                                WorkResult    *work_result,
+                                                gboolean       accepted,
+                                                const gchar   *reason);
+
+G_END_DECLS
+
+#endif /* __STRATUM_SERVER_H__ */
@@ -21,16 +21,65 @@
  * for more details.
  */
 
+#include <string.h>
+#include <time.h>
+
 #include "upstream-service.h"
+#include "hex-codec.h"
+#include "sha256d.h"
 
 #define CONFIG_GROUP_NAME "upstream-service"
 
 #define DEFAULT_URL "http://127.0.0.1:8332/"
 #define DEFAULT_WORK_CACHE_SIZE  10
+#define DEFAULT_WORK_PREFETCH_MAX 512
+#define DEFAULT_WORK_MAX_AGE     60
+#define DEFAULT_HEDGE_DELAY      500
+
+#define DEFAULT_WORK_CONNECTIONS 4
+
+/* backend health */
+#define BACKEND_MAX_FAILURES 3
+#define BACKEND_RETRY_DELAY  (10 * G_USEC_PER_SEC)
+
+/* adaptive work cache */
+#define DEMAND_WINDOW        G_USEC_PER_SEC
+#define EWMA_WEIGHT          0.25
+#define ADAPTIVE_CACHE_MIN   2
+#define ADAPTIVE_HEADROOM    2.0
+#define DEFAULT_TEMPLATE_REFRESH 30
+
+/* previous tips remembered, to tell work from a lagging backend */
+#define RECENT_TIPS 4
+
+#define WORK_SOURCE_GETWORK          "getwork"
+#define WORK_SOURCE_GETBLOCKTEMPLATE "getblocktemplate"
+
+#define WORK_HASH1 \
+  "00000000000000000000000000000000" \
+  "00000000000000000000000000000000" \
+  "00000080000000000000000000000000" \
+  "00000000000000000000000000010000"
+
+typedef struct
+{
+  gchar *url;
+
+  /* a few keep-alive clients per channel, used round-robin */
+  GPtrArray *channels[__UPSTREAM_CHANNEL_LAST__];
+  guint next_client[__UPSTREAM_CHANNEL_LAST__];
+
+  guint in_flight;
+  gdouble latency;
+  guint failures;
+  gint64 down_until;
+} Backend;
 
 struct _UpstreamService
 {
-  EvdJsonrpcHttpClient *rpc;
+  /* bitcoind nodes, the first one is the primary */
+  GPtrArray *backends;
+  guint hedge_delay;
 
   UpstreamServiceHasWorkCb has_work_cb;
   gpointer user_data;
@@ -40,11 +89,233 @@ struct _UpstreamService
   GQueue *work_queue;
   guint work_queue_min;
   guint work_requests;
+  guint work_prefetch_max;
+  gint64 work_max_age;
+  gint64 last_work_time;
+  Backend *last_work_backend;
+
+  /* backend each getwork item served comes from, by the merkle root
+     in its data, for the current and previous blocks. Only that
+     backend can judge a solution to it */
+  GHashTable *work_origins;
+  GHashTable *work_origins_prev;
+
+  /* bumped on every new block, getwork replies from an older epoch
+     carry work on top of a stale block */
+  guint epoch;
+  guint64 stale_work_count;
+  guint stale_work_reported;
+
+  /* previous block of the work being fetched, as in block headers;
+     upstream work on top of anything else means a new block */
+  guint8 tip_hash[32];
+  gboolean has_tip_hash;
+  guint8 recent_tips[RECENT_TIPS][32];
+  guint recent_tips_len;
+  UpstreamServiceTipCb tip_cb;
+  gpointer tip_cb_user_data;
+
+  /* 'work-cache-size = auto' sizes the cache out of getwork demand
+     and upstream latency */
+  gboolean adaptive_cache;
+  gdouble demand_rate;
+  guint demand_count;
+  gint64 demand_window_start;
+  guint demand_src_id;
+  gdouble rpc_latency;
+
+  GByteArray *payout_script;
+  guint template_refresh;
+  UpstreamServiceTemplateCb template_cb;
+  gpointer template_cb_user_data;
+  BlockTemplate *block_template;
+  gboolean template_requested;
+  gboolean template_outdated;
+  guint template_src_id;
+
+  gboolean local_work;
+  guint32 extranonce2_count;
+  time_t template_time;
 };
 
-static void rpc_on_getwork (GObject      *obj,
-                            GAsyncResult *result,
-                            gpointer      user_data);
+typedef struct
+{
+  JsonNode *work;
+  gint64 time;
+  Backend *backend;
+} CachedWork;
+
+typedef struct
+{
+  UpstreamService *self;
+  gint64 start;
+  guint epoch;
+} WorkFetch;
+
+typedef enum
+{
+  PREV_HASH_TIP,
+  PREV_HASH_OLD,
+  PREV_HASH_UNKNOWN
+} PrevHashKind;
+
+/* replies of calls that go to whichever backend answers first, which
+   is 'backend' unless all of them failed */
+typedef void (* UpstreamReplyFunc) (UpstreamService *self,
+                                    Backend         *backend,
+                                    JsonNode        *result,
+                                    GError          *error,
+                                    gpointer         user_data);
+
+typedef struct
+{
+  UpstreamService *self;
+  gchar *method;
+  JsonNode *params;
+  UpstreamReplyFunc func;
+  gpointer user_data;
+
+  Backend *first;
+  guint attempts;
+  guint pending;
+  gboolean answered;
+  guint hedge_src_id;
+} UpstreamCall;
+
+typedef struct
+{
+  UpstreamCall *call;
+  Backend *backend;
+  gint64 start;
+} UpstreamAttempt;
+
+typedef struct
+{
+  GSimpleAsyncResult *res;
+  guint pending;
+  gboolean answered;
+  gboolean completed;
+} SubmitCall;
+
+typedef struct
+{
+  SubmitCall *submit;
+  gboolean primary;
+} SubmitAttempt;
+
+typedef enum
+{
+  SUBMIT_REJECTED,
+  SUBMIT_ACCEPTED,
+  SUBMIT_ACCEPTED_BY_PRIMARY
+} SubmitOutcome;
+
+static void     rpc_on_getwork   (UpstreamService *self,
+                                  Backend         *backend,
+                                  JsonNode        *result,
+                                  GError          *error,
+                                  gpointer         user_data);
+static void     fetch_template   (UpstreamService *self);
+static gboolean on_demand_window (gpointer         user_data);
+
+static const gchar *channel_names[__UPSTREAM_CHANNEL_LAST__] =
+  {
+    "work",
+    "monitor",
+    "submit",
+    "longpoll"
+  };
+
+static Backend *
+backend_new (const gchar *url,
+             const gchar *user,
+             const gchar *passw,
+             const guint *pool_sizes)
+{
+  Backend *backend;
+  EvdJsonrpcHttpClient *rpc;
+  EvdHttpRequest *http_req;
+  guint i;
+  guint j;
+
+  backend = g_slice_new0 (Backend);
+  backend->url = g_strdup (url);
+
+  for (i=0; i<__UPSTREAM_CHANNEL_LAST__; i++)
+    {
+      backend->channels[i] = g_ptr_array_new_with_free_func (g_object_unref);
+
+      for (j=0; j<pool_sizes[i]; j++)
+        {
+          rpc = evd_jsonrpc_http_client_new (url);
+          http_req = evd_jsonrpc_http_client_get_http_request (rpc);
+          evd_http_request_set_basic_auth_credentials (http_req, user, passw);
+
+          g_ptr_array_add (backend->channels[i], rpc);
+        }
+    }
+
+  return backend;
+}
+
+static void
+backend_free (Backend *backend)
+{
+  guint i;
+
+  for (i=0; i<__UPSTREAM_CHANNEL_LAST__; i++)
+    g_ptr_array_unref (backend->channels[i]);
+  g_free (backend->url);
+
+  g_slice_free (Backend, backend);
+}
+
+static EvdJsonrpcHttpClient *
+backend_get_rpc (Backend *backend, UpstreamChannel channel)
+{
+  GPtrArray *clients = backend->channels[channel];
+  guint i;
+
+  i = backend->next_client[channel]++ % clients->len;
+
+  return g_ptr_array_index (clients, i);
+}
+
+static GHashTable *
+work_origins_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+/* work data holds the merkle root at characters 72..136 */
+static void
+record_work_origin (UpstreamService *self, JsonNode *work, Backend *backend)
+{
+  const gchar *data;
+
+  data = json_object_get_string_member (json_node_get_object (work), "data");
+  if (data != NULL && strlen (data) >= 136)
+    g_hash_table_replace (self->work_origins,
+                          g_strndup (data + 72, 64),
+                          backend);
+}
+
+/* the backend that issued the work 'data' solves, or NULL */
+static Backend *
+lookup_work_origin (UpstreamService *self, const gchar *data)
+{
+  gchar merkle_root[65];
+  Backend *backend;
+
+  memcpy (merkle_root, data + 72, 64);
+  merkle_root[64] = '\0';
+
+  backend = g_hash_table_lookup (self->work_origins, merkle_root);
+  if (backend == NULL)
+    backend = g_hash_table_lookup (self->work_origins_prev, merkle_root);
+
+  return backend;
+}
 
 UpstreamService *
 upstream_service_new (GKeyFile                  *config,
@@ -53,15 +324,41 @@ upstream_service_new (GKeyFile                  *config,
                       GError                   **error)
 {
   UpstreamService *self = NULL;
-  EvdHttpRequest *http_req;
 
+  gchar **urls = NULL;
   gchar *url = NULL;
   gchar *user = NULL;
   gchar *passw = NULL;
+  gchar *payout_address = NULL;
+  GByteArray *payout_script = NULL;
+  gchar *work_source = NULL;
+  gboolean local_work = FALSE;
+  gchar *cache_size;
+  guint pool_sizes[__UPSTREAM_CHANNEL_LAST__];
+  gchar *key;
+  guint i;
+
+  /* 'urls' lists several nodes, 'url' is kept for a single one */
+  urls = g_key_file_get_string_list (config,
+                                     CONFIG_GROUP_NAME,
+                                     "urls",
+                                     NULL,
+                                     NULL);
+  if (urls == NULL || urls[0] == NULL)
+    {
+      g_strfreev (urls);
 
-  url = g_key_file_get_string (config, CONFIG_GROUP_NAME, "url", NULL);
-  if (url == NULL || url[0] == '\0')
-    url = g_strdup (DEFAULT_URL);
+      url = g_key_file_get_string (config, CONFIG_GROUP_NAME, "url", NULL);
+      if (url == NULL || url[0] == '\0')
+        {
+          g_free (url);
+          url = g_strdup (DEFAULT_URL);
+        }
+
+      urls = g_new0 (gchar *, 2);
+      urls[0] = url;
+      url = NULL;
+    }
 
   user = g_key_file_get_string (config, CONFIG_GROUP_NAME, "user", NULL);
   if (user == NULL || user[0] == '\0')
@@ -83,71 +380,676 @@ upstream_service_new (GKeyFile                  *config,
       goto out;
     }
 
+  payout_address = g_key_file_get_string (config,
+                                          CONFIG_GROUP_NAME,
+                                          "payout-address",
+                                          NULL);
+  if (payout_address != NULL && payout_address[0] != '\0')
+    {
+      payout_script = block_template_address_to_script (payout_address, error);
+      if (payout_script == NULL)
+        goto out;
+    }
+
+  work_source = g_key_file_get_string (config,
+                                       CONFIG_GROUP_NAME,
+                                       "work-source",
+                                       NULL);
+  if (g_strcmp0 (work_source, WORK_SOURCE_GETBLOCKTEMPLATE) == 0)
+    {
+      if (payout_script == NULL)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "Work source '%s' requires a payout address",
+                       work_source);
+          goto out;
+        }
+
+      local_work = TRUE;
+    }
+  else if (work_source != NULL &&
+           work_source[0] != '\0' &&
+           g_strcmp0 (work_source, WORK_SOURCE_GETWORK) != 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Unknown work source '%s'",
+                   work_source);
+      goto out;
+    }
+
   self = g_slice_new0 (UpstreamService);
 
-  /* JSON-RPC HTTP client */
-  self->rpc = evd_jsonrpc_http_client_new (url);
-  http_req = evd_jsonrpc_http_client_get_http_request (self->rpc);
-  evd_http_request_set_basic_auth_credentials (http_req,
-                                               user,
-                                               passw);
-
-  self->work_queue_min = g_key_file_get_integer (config,
-                                                 CONFIG_GROUP_NAME,
-                                                 "work-cache-size",
-                                                 NULL);
+  self->payout_script = payout_script;
+  payout_script = NULL;
+
+  self->local_work = local_work;
+
+  /* connections per channel, e.g. 'work-connections' */
+  for (i=0; i<__UPSTREAM_CHANNEL_LAST__; i++)
+    {
+      key = g_strdup_printf ("%s-connections", channel_names[i]);
+      pool_sizes[i] = g_key_file_get_integer (config,
+                                              CONFIG_GROUP_NAME,
+                                              key,
+                                              NULL);
+      g_free (key);
+
+      if (pool_sizes[i] == 0)
+        pool_sizes[i] = i == UPSTREAM_CHANNEL_WORK ? DEFAULT_WORK_CONNECTIONS : 1;
+    }
+
+  /* JSON-RPC HTTP clients, per backend and channel */
+  self->backends = g_ptr_array_new_with_free_func ((GDestroyNotify) backend_free);
+  for (i=0; urls[i] != NULL; i++)
+    g_ptr_array_add (self->backends,
+                     backend_new (g_strstrip (urls[i]), user, passw, pool_sizes));
+
+  self->hedge_delay = g_key_file_get_integer (config,
+                                              CONFIG_GROUP_NAME,
+                                              "hedge-delay",
+                                              NULL);
+  if (self->hedge_delay == 0)
+    self->hedge_delay = DEFAULT_HEDGE_DELAY;
+
+  cache_size = g_key_file_get_string (config,
+                                      CONFIG_GROUP_NAME,
+                                      "work-cache-size",
+                                      NULL);
+  if (g_strcmp0 (cache_size, "auto") == 0)
+    {
+      self->adaptive_cache = TRUE;
+      self->work_queue_min = ADAPTIVE_CACHE_MIN;
+
+      self->demand_window_start = g_get_monotonic_time ();
+      self->demand_src_id = evd_timeout_add (NULL,
+                                             DEMAND_WINDOW / 1000,
+                                             G_PRIORITY_DEFAULT,
+                                             on_demand_window,
+                                             self);
+    }
+  else if (cache_size != NULL)
+    {
+      self->work_queue_min = (guint) g_ascii_strtoull (cache_size, NULL, 10);
+    }
+  g_free (cache_size);
+
   if (self->work_queue_min == 0)
     self->work_queue_min = DEFAULT_WORK_CACHE_SIZE;
 
+  self->work_max_age = g_key_file_get_integer (config,
+                                               CONFIG_GROUP_NAME,
+                                               "work-max-age",
+                                               NULL);
+  if (self->work_max_age <= 0)
+    self->work_max_age = DEFAULT_WORK_MAX_AGE;
+  self->work_max_age *= G_USEC_PER_SEC;
+
+  self->work_prefetch_max = g_key_file_get_integer (config,
+                                                    CONFIG_GROUP_NAME,
+                                                    "work-prefetch-max",
+                                                    NULL);
+  if (self->work_prefetch_max == 0)
+    self->work_prefetch_max = DEFAULT_WORK_PREFETCH_MAX;
+
+  self->template_refresh = g_key_file_get_integer (config,
+                                                   CONFIG_GROUP_NAME,
+                                                   "template-refresh",
+                                                   NULL);
+  if (self->template_refresh == 0)
+    self->template_refresh = DEFAULT_TEMPLATE_REFRESH;
+
+  self->work_origins = work_origins_new ();
+  self->work_origins_prev = work_origins_new ();
+
   self->has_work_cb = has_work_callback;
   self->user_data = user_data;
 
  out:
-  g_free (url);
+  g_strfreev (urls);
   g_free (user);
   g_free (passw);
+  g_free (payout_address);
+  g_free (work_source);
+  if (payout_script != NULL)
+    g_byte_array_unref (payout_script);
 
   return self;
 }
 
+static void
+cached_work_free (CachedWork *cached)
+{
+  json_node_free (cached->work);
+  g_slice_free (CachedWork, cached);
+}
+
+static CachedWork *
+cached_work_new (JsonNode *work, gint64 time, Backend *backend)
+{
+  CachedWork *cached;
+
+  cached = g_slice_new (CachedWork);
+  cached->work = work;
+  cached->time = time;
+  cached->backend = backend;
+
+  return cached;
+}
+
+/* work is served oldest first, so old work sits at the head */
+static void
+discard_old_work (UpstreamService *self)
+{
+  CachedWork *cached;
+  gint64 oldest;
+
+  oldest = g_get_monotonic_time () - self->work_max_age;
+
+  while ((cached = g_queue_peek_head (self->work_queue)) != NULL &&
+         cached->time < oldest)
+    {
+      g_queue_pop_head (self->work_queue);
+      cached_work_free (cached);
+    }
+}
+
+static void
+update_demand (UpstreamService *self)
+{
+  gint64 now;
+  gint64 elapsed;
+  gdouble rate;
+
+  now = g_get_monotonic_time ();
+  elapsed = now - self->demand_window_start;
+  if (elapsed <= 0)
+    return;
+
+  rate = (gdouble) self->demand_count * G_USEC_PER_SEC / elapsed;
+  self->demand_rate += EWMA_WEIGHT * (rate - self->demand_rate);
+
+  self->demand_count = 0;
+  self->demand_window_start = now;
+}
+
+static void
+update_cache_size (UpstreamService *self)
+{
+  gdouble size;
+
+  /* work needed to cover the time a getwork takes to come back, with
+     headroom for bursts */
+  size = self->demand_rate * self->rpc_latency / G_USEC_PER_SEC;
+  size = size * ADAPTIVE_HEADROOM + 1;
+
+  self->work_queue_min = CLAMP ((guint) size,
+                                ADAPTIVE_CACHE_MIN,
+                                self->work_prefetch_max);
+}
+
+/* demand is sampled on a timer, so that it decays to nothing while no
+   work is asked for, and the cache shrinks with it */
+static gboolean
+on_demand_window (gpointer user_data)
+{
+  UpstreamService *self = user_data;
+
+  update_demand (self);
+  update_cache_size (self);
+
+  return TRUE;
+}
+
 void
 upstream_service_free (UpstreamService *self)
 {
   if (self == NULL)
     return;
 
+  if (self->demand_src_id != 0)
+    g_source_remove (self->demand_src_id);
+
   if (self->work_queue != NULL)
-    g_queue_free_full (self->work_queue, (GDestroyNotify) json_node_free);
-  g_object_unref (self->rpc);
+    g_queue_free_full (self->work_queue, (GDestroyNotify) cached_work_free);
+  g_hash_table_unref (self->work_origins);
+  g_hash_table_unref (self->work_origins_prev);
+  g_ptr_array_unref (self->backends);
+
+  if (self->template_src_id != 0)
+    g_source_remove (self->template_src_id);
+  if (self->block_template != NULL)
+    block_template_unref (self->block_template);
+  if (self->payout_script != NULL)
+    g_byte_array_unref (self->payout_script);
 
   g_slice_free (UpstreamService, self);
 }
 
+static gboolean
+backend_is_up (Backend *backend, gint64 now)
+{
+  return backend->down_until <= now;
+}
+
 static void
-fill_work_queue (UpstreamService *self)
+backend_update_health (Backend *backend, gboolean ok, gint64 latency)
+{
+  if (ok)
+    {
+      backend->failures = 0;
+      backend->down_until = 0;
+      backend->latency += EWMA_WEIGHT * (latency - backend->latency);
+      return;
+    }
+
+  backend->failures++;
+  if (backend->failures >= BACKEND_MAX_FAILURES)
+    {
+      if (backend->down_until == 0)
+        g_print ("UPSTREAM: Backend %s is down\n", backend->url);
+
+      backend->down_until = g_get_monotonic_time () + BACKEND_RETRY_DELAY;
+    }
+}
+
+/* healthy backend expected to answer soonest, skipping 'exclude' */
+static Backend *
+pick_backend (UpstreamService *self, Backend *exclude)
 {
+  Backend *best = NULL;
+  Backend *backend;
+  gdouble best_cost = 0;
+  gdouble cost;
+  gint64 now;
+  guint i;
+
+  now = g_get_monotonic_time ();
+
+  for (i=0; i<self->backends->len; i++)
+    {
+      backend = g_ptr_array_index (self->backends, i);
+      if (backend == exclude || ! backend_is_up (backend, now))
+        continue;
+
+      cost = (backend->in_flight + 1) * (backend->latency + 1);
+      if (best == NULL || cost < best_cost)
+        {
+          best = backend;
+          best_cost = cost;
+        }
+    }
+
+  /* with everything down, keep trying the primary */
+  if (best == NULL && exclude == NULL)
+    best = g_ptr_array_index (self->backends, 0);
+
+  return best;
+}
+
+static void
+upstream_call_free (UpstreamCall *call)
+{
+  if (call->hedge_src_id != 0)
+    g_source_remove (call->hedge_src_id);
+
+  g_free (call->method);
+  json_node_free (call->params);
+
+  g_slice_free (UpstreamCall, call);
+}
+
+static void upstream_call_send (UpstreamCall *call, Backend *backend);
+
+static void
+upstream_call_on_reply (GObject      *obj,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  UpstreamAttempt *attempt = user_data;
+  UpstreamCall *call = attempt->call;
+  Backend *backend = attempt->backend;
+  JsonNode *json_result = NULL;
+  JsonNode *json_error = NULL;
+  GError *error = NULL;
+  Backend *other;
+
+  backend->in_flight--;
+  call->pending--;
+
+  if (evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
+                                                  result,
+                                                  &json_result,
+                                                  &json_error,
+                                                  &error) &&
+      json_error != NULL && ! JSON_NODE_HOLDS_NULL (json_error))
+    {
+      g_set_error (&error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_FAILED,
+                   "%s returned an error",
+                   call->method);
+    }
+  json_node_free (json_error);
+
+  backend_update_health (backend,
+                         error == NULL,
+                         g_get_monotonic_time () - attempt->start);
+  g_slice_free (UpstreamAttempt, attempt);
+
+  if (call->answered)
+    {
+      /* the other backend was faster */
+      json_node_free (json_result);
+    }
+  else if (error == NULL)
+    {
+      call->answered = TRUE;
+      call->func (call->self, backend, json_result, NULL, call->user_data);
+    }
+  else if (call->pending == 0 &&
+           call->attempts == 1 &&
+           (other = pick_backend (call->self, backend)) != NULL)
+    {
+      /* fail over right away */
+      json_node_free (json_result);
+      upstream_call_send (call, other);
+    }
+  else if (call->pending == 0)
+    {
+      call->answered = TRUE;
+      json_node_free (json_result);
+      call->func (call->self, NULL, NULL, error, call->user_data);
+    }
+  else
+    {
+      json_node_free (json_result);
+    }
+
+  if (error != NULL)
+    g_error_free (error);
+
+  if (call->answered && call->pending == 0)
+    upstream_call_free (call);
+}
+
+static gboolean
+upstream_call_on_hedge (gpointer user_data)
+{
+  UpstreamCall *call = user_data;
+  Backend *other;
+
+  call->hedge_src_id = 0;
+
+  other = pick_backend (call->self, call->first);
+  if (other != NULL && ! call->answered && call->attempts == 1)
+    upstream_call_send (call, other);
+
+  return FALSE;
+}
+
+static void
+upstream_call_send (UpstreamCall *call, Backend *backend)
+{
+  UpstreamAttempt *attempt;
+
+  attempt = g_slice_new (UpstreamAttempt);
+  attempt->call = call;
+  attempt->backend = backend;
+  attempt->start = g_get_monotonic_time ();
+
+  call->attempts++;
+  call->pending++;
+  backend->in_flight++;
+
+  evd_jsonrpc_http_client_call_method (backend_get_rpc (backend,
+                                                        UPSTREAM_CHANNEL_WORK),
+                                       call->method,
+                                       call->params,
+                                       NULL,
+                                       upstream_call_on_reply,
+                                       attempt);
+}
+
+/* sends 'method' to the best backend. If it is slow to answer, the
+   call is repeated on a second one and the first reply wins */
+static void
+call_upstream (UpstreamService   *self,
+               const gchar       *method,
+               JsonNode          *params,
+               UpstreamReplyFunc  func,
+               gpointer           user_data)
+{
+  UpstreamCall *call;
+
+  call = g_slice_new0 (UpstreamCall);
+  call->self = self;
+  call->method = g_strdup (method);
+  call->params = params != NULL ? json_node_copy (params) : NULL;
+  call->func = func;
+  call->user_data = user_data;
+
+  call->first = pick_backend (self, NULL);
+  upstream_call_send (call, call->first);
+
+  if (self->backends->len > 1)
+    call->hedge_src_id = evd_timeout_add (NULL,
+                                          self->hedge_delay,
+                                          G_PRIORITY_DEFAULT,
+                                          upstream_call_on_hedge,
+                                          call);
+}
+
+static void
+request_work (UpstreamService *self, guint count)
+{
+  /* local work is built on demand out of the block template */
+  if (self->local_work)
+    return;
+
   while (self->work_requests +
-         g_queue_get_length (self->work_queue) < self->work_queue_min)
+         g_queue_get_length (self->work_queue) < count)
     {
+      WorkFetch *fetch;
+
+      fetch = g_slice_new (WorkFetch);
+      fetch->self = self;
+      fetch->start = g_get_monotonic_time ();
+      fetch->epoch = self->epoch;
+
       self->work_requests++;
-      evd_jsonrpc_http_client_call_method (self->rpc,
-                                           "getwork",
-                                           NULL,
-                                           NULL,
-                                           rpc_on_getwork,
-                                           self);
+      call_upstream (self, "getwork", NULL, rpc_on_getwork, fetch);
     }
 }
 
 static void
-rpc_on_getwork (GObject      *obj,
-                GAsyncResult *result,
-                gpointer      user_data)
+fill_work_queue (UpstreamService *self)
+{
+  request_work (self, self->work_queue_min);
+}
+
+static gboolean
+refresh_template (gpointer user_data)
 {
   UpstreamService *self = user_data;
+
+  self->template_src_id = 0;
+  fetch_template (self);
+
+  return FALSE;
+}
+
+/* where 'prev_hash', as given by 'backend', stands against the known
+   tip. A block never seen is reported first, which may make it the tip */
+static PrevHashKind
+check_prev_hash (UpstreamService *self,
+                 Backend         *backend,
+                 const guint8    *prev_hash)
+{
+  guint i;
+
+  if (! self->has_tip_hash || memcmp (self->tip_hash, prev_hash, 32) == 0)
+    return PREV_HASH_TIP;
+
+  for (i=0; i<self->recent_tips_len; i++)
+    if (memcmp (self->recent_tips[i], prev_hash, 32) == 0)
+      return PREV_HASH_OLD;
+
+  if (self->tip_cb != NULL)
+    self->tip_cb (self,
+                  prev_hash,
+                  backend == g_ptr_array_index (self->backends, 0),
+                  self->tip_cb_user_data);
+
+  /* the callback may have moved the tip right here */
+  if (self->has_tip_hash && memcmp (self->tip_hash, prev_hash, 32) == 0)
+    return PREV_HASH_TIP;
+  else
+    return PREV_HASH_UNKNOWN;
+}
+
+static void
+rpc_on_getblocktemplate (UpstreamService *self,
+                         Backend         *backend,
+                         JsonNode        *json_result,
+                         GError          *error,
+                         gpointer         user_data)
+{
+  BlockTemplate *block_template;
+
+  self->template_requested = FALSE;
+
+  if (error != NULL)
+    {
+      g_print ("Getblocktemplate failed: %s\n", error->message);
+    }
+  else if (self->template_outdated)
+    {
+      /* a new block arrived while the template was being fetched */
+      json_node_free (json_result);
+    }
+  else
+    {
+      GError *tmpl_error = NULL;
+
+      block_template = block_template_new (json_result,
+                                           self->payout_script,
+                                           &tmpl_error);
+      if (block_template == NULL)
+        {
+          g_print ("Invalid block template: %s\n", tmpl_error->message);
+          g_error_free (tmpl_error);
+        }
+      else if (check_prev_hash (self,
+                                backend,
+                                block_template_get_prev_hash (block_template)) !=
+               PREV_HASH_TIP)
+        {
+          /* built on top of an older block, or of one not confirmed
+             as the tip yet */
+          block_template_unref (block_template);
+        }
+      else
+        {
+          gboolean clean;
+
+          clean = self->block_template == NULL ||
+            memcmp (block_template_get_prev_hash (self->block_template),
+                    block_template_get_prev_hash (block_template),
+                    32) != 0;
+
+          if (self->block_template != NULL)
+            block_template_unref (self->block_template);
+          self->block_template = block_template;
+          self->template_time = time (NULL);
+
+          if (self->template_cb != NULL)
+            self->template_cb (self,
+                               block_template,
+                               clean,
+                               self->template_cb_user_data);
+
+          if (self->local_work)
+            self->has_work_cb (self, NULL, self->user_data);
+        }
+
+      json_node_free (json_result);
+    }
+
+  if (self->template_outdated)
+    {
+      self->template_outdated = FALSE;
+      fetch_template (self);
+      return;
+    }
+
+  if (self->template_src_id != 0)
+    g_source_remove (self->template_src_id);
+  self->template_src_id = evd_timeout_add (NULL,
+                                           self->template_refresh * 1000,
+                                           G_PRIORITY_DEFAULT,
+                                           refresh_template,
+                                           self);
+}
+
+static void
+fetch_template (UpstreamService *self)
+{
+  JsonNode *params;
+  JsonArray *arr;
+  JsonObject *obj;
+  JsonArray *rules;
+
+  if (self->template_requested)
+    {
+      self->template_outdated = TRUE;
+      return;
+    }
+
+  self->template_requested = TRUE;
+
+  rules = json_array_new ();
+  json_array_add_string_element (rules, "segwit");
+
+  obj = json_object_new ();
+  json_object_set_array_member (obj, "rules", rules);
+
+  params = json_node_new (JSON_NODE_ARRAY);
+  arr = json_array_new ();
+  json_node_set_array (params, arr);
+  json_array_add_object_element (arr, obj);
+
+  call_upstream (self,
+                 "getblocktemplate",
+                 params,
+                 rpc_on_getblocktemplate,
+                 NULL);
+
+  json_array_unref (arr);
+  json_node_free (params);
+}
+
+/* block candidates may go to several backends. The first acceptance
+   completes the submission, otherwise the last reply does: a rejection
+   if any backend answered at all */
+static void
+rpc_on_submit_work (GObject      *obj,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  SubmitAttempt *attempt = user_data;
+  SubmitCall *submit = attempt->submit;
+  GSimpleAsyncResult *res = submit->res;
   JsonNode *json_result;
   JsonNode *json_error;
   GError *error = NULL;
+  gboolean accepted = FALSE;
+  SubmitOutcome outcome;
+
+  submit->pending--;
 
   if (! evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
                                                     result,
@@ -155,56 +1057,495 @@ rpc_on_getwork (GObject      *obj,
                                                     &json_error,
                                                     &error))
     {
-      g_print ("Getwork failed: %s\n", error->message);
+      if (! submit->completed && submit->pending == 0)
+        {
+          if (submit->answered)
+            g_simple_async_result_set_op_res_gssize (res, SUBMIT_REJECTED);
+          else
+            g_simple_async_result_set_from_error (res, error);
+        }
       g_error_free (error);
-      return;
     }
   else
     {
-      g_queue_push_head (self->work_queue, json_result);
+      submit->answered = TRUE;
 
-      self->has_work_cb (self, json_result, self->user_data);
+      /* getwork answers a boolean, submitblock answers null on success
+         or the reason of the rejection; an error reply is a rejection
+         whatever the result */
+      if (json_error != NULL && ! JSON_NODE_HOLDS_NULL (json_error))
+        accepted = FALSE;
+      else if (json_result == NULL || JSON_NODE_HOLDS_NULL (json_result))
+        accepted = TRUE;
+      else if (JSON_NODE_HOLDS_VALUE (json_result) &&
+               json_node_get_value_type (json_result) == G_TYPE_BOOLEAN)
+        accepted = json_node_get_boolean (json_result);
 
+      /* the primary's acceptance tells the pool's tip has moved */
+      if (! accepted)
+        outcome = SUBMIT_REJECTED;
+      else if (attempt->primary)
+        outcome = SUBMIT_ACCEPTED_BY_PRIMARY;
+      else
+        outcome = SUBMIT_ACCEPTED;
+
+      if (! submit->completed && (accepted || submit->pending == 0))
+        g_simple_async_result_set_op_res_gssize (res, outcome);
+
+      json_node_free (json_result);
       json_node_free (json_error);
     }
 
-  self->work_requests--;
+  if (! submit->completed && (accepted || submit->pending == 0))
+    {
+      submit->completed = TRUE;
+      g_simple_async_result_complete (res);
+    }
+
+  g_slice_free (SubmitAttempt, attempt);
+
+  if (submit->pending == 0)
+    {
+      g_object_unref (res);
+      g_slice_free (SubmitCall, submit);
+    }
+}
+
+/* sends to 'only' if not NULL, otherwise to every backend */
+static void
+submit_to_backends (UpstreamService    *self,
+                    const gchar        *method,
+                    JsonNode           *params,
+                    Backend            *only,
+                    GSimpleAsyncResult *res)
+{
+  SubmitCall *submit;
+  SubmitAttempt *attempt;
+  Backend *backend;
+  guint i;
+
+  submit = g_slice_new0 (SubmitCall);
+  submit->res = res;
+  submit->pending = only != NULL ? 1 : self->backends->len;
+
+  for (i=0; i<self->backends->len; i++)
+    {
+      backend = g_ptr_array_index (self->backends, i);
+      if (only != NULL && backend != only)
+        continue;
+
+      attempt = g_slice_new (SubmitAttempt);
+      attempt->submit = submit;
+      attempt->primary = i == 0;
+
+      evd_jsonrpc_http_client_call_method (backend_get_rpc (backend,
+                                                            UPSTREAM_CHANNEL_SUBMIT),
+                                           method,
+                                           params,
+                                           NULL,
+                                           rpc_on_submit_work,
+                                           attempt);
+    }
+}
+
+static void
+rpc_on_getwork (UpstreamService *self,
+                Backend         *backend,
+                JsonNode        *json_result,
+                GError          *error,
+                gpointer         user_data)
+{
+  WorkFetch *fetch = user_data;
+  gint64 start = fetch->start;
+  gboolean stale;
+  gint64 now;
+  const gchar *data;
+  guint8 prev_hash[32];
+  PrevHashKind kind;
+
+  now = g_get_monotonic_time ();
+  stale = fetch->epoch != self->epoch;
+  g_slice_free (WorkFetch, fetch);
+
+  /* requests from older epochs were written off at the block change */
+  if (! stale)
+    self->work_requests--;
+
+  if (error != NULL)
+    {
+      g_print ("Getwork failed: %s\n", error->message);
+      return;
+    }
+  else if (stale)
+    {
+      self->stale_work_count++;
+      self->stale_work_reported++;
+
+      json_node_free (json_result);
+      return;
+    }
+  else
+    {
+      self->rpc_latency += EWMA_WEIGHT * ((now - start) - self->rpc_latency);
+
+      /* the previous block hash sits at bytes 4..36 of the header */
+      data = json_object_get_string_member (json_node_get_object (json_result),
+                                            "data");
+      if (data != NULL &&
+          strlen (data) >= 72 &&
+          hex_codec_decode_swap32 (data + 8, prev_hash, 32))
+        kind = check_prev_hash (self, backend, prev_hash);
+      else
+        kind = PREV_HASH_TIP;
+
+      if (kind != PREV_HASH_TIP)
+        {
+          /* a lagging backend still works on an older block, which
+             makes stale work. Otherwise the backend is ahead of the
+             primary or on another branch, and the tip check started
+             by the report tells which; drop it meanwhile */
+          if (kind == PREV_HASH_OLD)
+            {
+              self->stale_work_count++;
+              self->stale_work_reported++;
+            }
+
+          json_node_free (json_result);
+          fill_work_queue (self);
+          return;
+        }
+
+      g_queue_push_tail (self->work_queue,
+                         cached_work_new (json_result, now, backend));
+
+      self->has_work_cb (self, json_result, self->user_data);
+    }
 
   fill_work_queue (self);
 }
 
 void
-upstream_service_notify_new_block (UpstreamService *self, guint block)
+upstream_service_notify_new_block (UpstreamService *self,
+                                   guint            block,
+                                   const guint8    *hash)
 {
+  if (self->has_tip_hash &&
+      (hash == NULL || memcmp (self->tip_hash, hash, 32) != 0))
+    {
+      memmove (self->recent_tips[1],
+               self->recent_tips[0],
+               (RECENT_TIPS - 1) * 32);
+      memcpy (self->recent_tips[0], self->tip_hash, 32);
+      self->recent_tips_len = MIN (self->recent_tips_len + 1, RECENT_TIPS);
+    }
+
+  self->has_tip_hash = hash != NULL;
+  if (hash != NULL)
+    memcpy (self->tip_hash, hash, 32);
+
   if (self->work_queue != NULL)
-    g_queue_free_full (self->work_queue, (GDestroyNotify) json_node_free);
+    g_queue_free_full (self->work_queue, (GDestroyNotify) cached_work_free);
 
   self->work_queue = g_queue_new ();
+
+  g_hash_table_unref (self->work_origins_prev);
+  self->work_origins_prev = self->work_origins;
+  self->work_origins = work_origins_new ();
+
+  /* requests still in flight belong to the old block */
+  self->epoch++;
   self->work_requests = 0;
 
+  if (self->stale_work_reported > 0)
+    {
+      g_print ("UPSTREAM: Discarded %u late work items from older blocks\n",
+               self->stale_work_reported);
+      self->stale_work_reported = 0;
+    }
+
   fill_work_queue (self);
+
+  if (self->local_work && self->block_template != NULL)
+    {
+      /* stop building work on top of the old block */
+      block_template_unref (self->block_template);
+      self->block_template = NULL;
+    }
+
+  if (self->local_work || self->template_cb != NULL)
+    fetch_template (self);
 }
 
+/* a client of the primary backend, dedicated to 'channel' */
 EvdJsonrpcHttpClient *
-upstream_service_get_rpc (UpstreamService *self)
+upstream_service_get_rpc (UpstreamService *self, UpstreamChannel channel)
 {
-  return self->rpc;
+  Backend *backend;
+
+  g_return_val_if_fail (channel < __UPSTREAM_CHANNEL_LAST__, NULL);
+
+  backend = g_ptr_array_index (self->backends, 0);
+
+  return backend_get_rpc (backend, channel);
 }
 
 gboolean
 upstream_service_has_work (UpstreamService *self)
 {
+  if (self->local_work)
+    return self->block_template != NULL;
+
+  discard_old_work (self);
+
   return g_queue_get_length (self->work_queue) > 0;
 }
 
+static JsonNode *
+build_local_work (UpstreamService *self, guint8 *extranonce)
+{
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+  gchar data[BLOCK_TEMPLATE_WORK_DATA_SIZE + 1];
+  guint32 extranonce1 = BLOCK_TEMPLATE_LOCAL_EXTRANONCE1;
+  guint32 extranonce2;
+  guint32 ntime;
+  guint32 midstate[8];
+  guint8 midstate_bin[32];
+  gchar midstate_hex[65];
+  gint i;
+  JsonObject *obj;
+  JsonNode *work;
+
+  /* every work item gets a different coinbase, hence merkle root */
+  extranonce2 = self->extranonce2_count++;
+
+  extranonce[0] = (extranonce1 >> 24) & 0xFF;
+  extranonce[1] = (extranonce1 >> 16) & 0xFF;
+  extranonce[2] = (extranonce1 >> 8) & 0xFF;
+  extranonce[3] = extranonce1 & 0xFF;
+  extranonce[4] = (extranonce2 >> 24) & 0xFF;
+  extranonce[5] = (extranonce2 >> 16) & 0xFF;
+  extranonce[6] = (extranonce2 >> 8) & 0xFF;
+  extranonce[7] = extranonce2 & 0xFF;
+
+  ntime = block_template_get_curtime (self->block_template) +
+    (time (NULL) - self->template_time);
+
+  block_template_build_header (self->block_template,
+                               extranonce,
+                               ntime,
+                               0,
+                               header);
+  block_template_header_to_work_data (header, data);
+
+  /* legacy getwork miners hash from the midstate, which bitcoind gives
+     as its state words in little-endian */
+  sha256d_midstate (header, midstate);
+  for (i=0; i<8; i++)
+    {
+      guint32 word = GUINT32_TO_LE (midstate[i]);
+
+      memcpy (midstate_bin + i * 4, &word, 4);
+    }
+  hex_codec_encode (midstate_bin, 32, midstate_hex);
+
+  obj = json_object_new ();
+  json_object_set_string_member (obj, "midstate", midstate_hex);
+  json_object_set_string_member (obj, "data", data);
+  json_object_set_string_member (obj, "hash1", WORK_HASH1);
+
+  work = json_node_new (JSON_NODE_OBJECT);
+  json_node_take_object (work, obj);
+
+  return work;
+}
+
+/* to be called right after upstream_service_has_work() said TRUE, old
+   work is only aged out there so that what it saw is still here */
 JsonNode *
-upstream_service_get_work (UpstreamService *self)
+upstream_service_get_work (UpstreamService  *self,
+                           BlockTemplate   **block_template,
+                           guint8           *extranonce)
 {
   JsonNode *work;
+  CachedWork *cached;
+
+  if (self->local_work)
+    {
+      work = build_local_work (self, extranonce);
+      *block_template = self->block_template;
 
-  work = g_queue_pop_head (self->work_queue);
+      return work;
+    }
+
+  self->demand_count++;
+
+  cached = g_queue_pop_head (self->work_queue);
+  *block_template = NULL;
 
   fill_work_queue (self);
 
+  if (cached == NULL)
+    return NULL;
+
+  work = cached->work;
+  self->last_work_time = cached->time;
+  self->last_work_backend = cached->backend;
+  g_slice_free (CachedWork, cached);
+
+  record_work_origin (self, work, self->last_work_backend);
+
   return work;
 }
+
+guint64
+upstream_service_get_stale_work_count (UpstreamService *self)
+{
+  return self->stale_work_count;
+}
+
+/* makes sure there is work cached or on its way for 'demand' waiting
+   requests, all requested at once */
+void
+upstream_service_prefetch_work (UpstreamService *self, guint demand)
+{
+  request_work (self, MIN (demand, self->work_prefetch_max));
+}
+
+/* takes back a work item that could not be delivered */
+void
+upstream_service_return_work (UpstreamService *self, JsonNode *work)
+{
+  /* local work is built on demand, nothing is lost by dropping it */
+  if (self->local_work)
+    {
+      json_node_free (work);
+      return;
+    }
+
+  /* back at the head, it keeps its age */
+  g_queue_push_head (self->work_queue,
+                     cached_work_new (work,
+                                      self->last_work_time,
+                                      self->last_work_backend));
+}
+
+gboolean
+upstream_service_watch_templates (UpstreamService            *self,
+                                  UpstreamServiceTemplateCb   callback,
+                                  gpointer                    user_data,
+                                  GError                    **error)
+{
+  if (self->payout_script == NULL)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "No payout address specified");
+      return FALSE;
+    }
+
+  self->template_cb = callback;
+  self->template_cb_user_data = user_data;
+
+  fetch_template (self);
+
+  return TRUE;
+}
+
+/* 'callback' hears of upstream work on top of a block other than the
+   one last notified, usually before anything else tells of it */
+void
+upstream_service_watch_tip (UpstreamService      *self,
+                            UpstreamServiceTipCb  callback,
+                            gpointer              user_data)
+{
+  self->tip_cb = callback;
+  self->tip_cb_user_data = user_data;
+}
+
+void
+upstream_service_submit_work (UpstreamService     *self,
+                              WorkResult          *work_result,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data)
+{
+  GSimpleAsyncResult *res;
+  BlockTemplate *block_template;
+  JsonNode *params;
+  JsonArray *arr;
+
+  res = g_simple_async_result_new (NULL,
+                                   callback,
+                                   user_data,
+                                   upstream_service_submit_work);
+
+  params = json_node_new (JSON_NODE_ARRAY);
+  arr = json_array_new ();
+  json_node_set_array (params, arr);
+
+  block_template = work_result_get_block_template (work_result);
+  if (block_template == NULL)
+    {
+      gchar data[BLOCK_TEMPLATE_WORK_DATA_SIZE + 1];
+
+      /* work came from upstream's getwork, give it back the same way,
+         to the node that issued it */
+      block_template_header_to_work_data (work_result_get_header (work_result),
+                                          data);
+      json_array_add_string_element (arr, data);
+
+      submit_to_backends (self,
+                          "getwork",
+                          params,
+                          lookup_work_origin (self, data),
+                          res);
+    }
+  else
+    {
+      gchar *block_hex;
+
+      /* work was built locally, assemble the whole block */
+      block_hex =
+        block_template_build_block_hex (block_template,
+                                        work_result_get_header (work_result),
+                                        work_result_get_extranonce (work_result));
+      json_array_add_string_element (arr, block_hex);
+
+      submit_to_backends (self, "submitblock", params, NULL, res);
+
+      g_free (block_hex);
+    }
+
+  json_array_unref (arr);
+  json_node_free (params);
+}
+
+/* 'by_primary' tells whether the primary backend accepted the work,
+   and so already builds on top of it */
+gboolean
+upstream_service_submit_work_finish (UpstreamService  *self,
+                                     GAsyncResult     *result,
+                                     gboolean         *accepted,
+                                     gboolean         *by_primary,
+                                     GError          **error)
+{
+  GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (result);
+  SubmitOutcome outcome;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result,
+                                                        NULL,
+                                                        upstream_service_submit_work),
+                        FALSE);
+
+  if (g_simple_async_result_propagate_error (res, error))
+    return FALSE;
+
+  outcome = g_simple_async_result_get_op_res_gssize (res);
+
+  if (accepted != NULL)
+    *accepted = outcome != SUBMIT_REJECTED;
+  if (by_primary != NULL)
+    *by_primary = outcome == SUBMIT_ACCEPTED_BY_PRIMARY;
+
+  return TRUE;
+}
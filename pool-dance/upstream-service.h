@@ -26,27 +26,82 @@
 
 #include <evd.h>
 
+#include "block-template.h"
+#include "work-result.h"
+
 G_BEGIN_DECLS
 
 typedef struct _UpstreamService UpstreamService;
 
+/* separate connections to upstream per purpose, so that nothing urgent
+   waits behind bulk work fetches */
+typedef enum
+{
+  UPSTREAM_CHANNEL_WORK     = 0,
+  UPSTREAM_CHANNEL_MONITOR  = 1,
+  UPSTREAM_CHANNEL_SUBMIT   = 2,
+  UPSTREAM_CHANNEL_LONGPOLL = 3,
+
+  __UPSTREAM_CHANNEL_LAST__
+} UpstreamChannel;
+
 typedef void (* UpstreamServiceHasWorkCb) (UpstreamService  *self,
                                            JsonNode         *work,
                                            gpointer          user_data);
 
-UpstreamService *      upstream_service_new              (GKeyFile                  *config,
-                                                          UpstreamServiceHasWorkCb   has_work_callback,
-                                                          gpointer                   user_data,
-                                                          GError                   **error);
-void                   upstream_service_free             (UpstreamService *self);
+typedef void (* UpstreamServiceTemplateCb) (UpstreamService *self,
+                                            BlockTemplate   *block_template,
+                                            gboolean         clean,
+                                            gpointer         user_data);
+
+/* 'prev_hash' is byte ordered as in block headers. 'primary' tells
+   whether it comes from the first backend, whose word is taken on the
+   chain tip */
+typedef void (* UpstreamServiceTipCb) (UpstreamService *self,
+                                       const guint8    *prev_hash,
+                                       gboolean         primary,
+                                       gpointer         user_data);
+
+UpstreamService *      upstream_service_new                  (GKeyFile                  *config,
+                                                              UpstreamServiceHasWorkCb   has_work_callback,
+                                                              gpointer                   user_data,
+                                                              GError                   **error);
+void                   upstream_service_free                 (UpstreamService *self);
+
+EvdJsonrpcHttpClient * upstream_service_get_rpc              (UpstreamService *self,
+                                                              UpstreamChannel  channel);
+
+void                   upstream_service_notify_new_block     (UpstreamService *self,
+                                                              guint            block,
+                                                              const guint8    *hash);
+void                   upstream_service_watch_tip            (UpstreamService      *self,
+                                                              UpstreamServiceTipCb  callback,
+                                                              gpointer              user_data);
 
-EvdJsonrpcHttpClient * upstream_service_get_rpc          (UpstreamService *self);
+gboolean               upstream_service_has_work             (UpstreamService *self);
+JsonNode *             upstream_service_get_work             (UpstreamService  *self,
+                                                              BlockTemplate   **block_template,
+                                                              guint8           *extranonce);
+guint64                upstream_service_get_stale_work_count (UpstreamService *self);
+void                   upstream_service_prefetch_work        (UpstreamService *self,
+                                                              guint            demand);
+void                   upstream_service_return_work          (UpstreamService *self,
+                                                              JsonNode        *work);
 
-void                   upstream_service_notify_new_block (UpstreamService *self,
-                                                          guint            block);
+gboolean               upstream_service_watch_templates      (UpstreamService            *self,
+                                                              UpstreamServiceTemplateCb   callback,
+                                                              gpointer                    user_data,
+                                                              GError                    **error);
 
-gboolean               upstream_service_has_work         (UpstreamService *self);
-JsonNode *             upstream_service_get_work         (UpstreamService *self);
+void                   upstream_service_submit_work          (UpstreamService     *self,
+                                                              WorkResult          *work_result,
+                                                              GAsyncReadyCallback  callback,
+                                                              gpointer             user_data);
+gboolean               upstream_service_submit_work_finish   (UpstreamService  *self,
+                                                              GAsyncResult     *result,
+                                                              gboolean         *accepted,
+                                                              gboolean         *by_primary,
+                                                              GError          **error);
 
 G_END_DECLS
 
@@ -26,28 +26,91 @@
 struct _WorkResult
 {
   gint ref_count;
-  EvdHttpConnection *conn;
+  EvdConnection *conn;
   EvdHttpRequest *req;
-  JsonNode *work;
   guint invocation_id;
+
+  /* the submitted data, decoded once when the result is created */
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+  gboolean header_valid;
+
   gboolean stale;
+  gdouble difficulty;
+  gboolean block_candidate;
+
+  /* client info, taken from the HTTP request if there is one */
+  gchar *user;
+  gchar *passw;
+  gchar *user_agent;
+
+  BlockTemplate *block_template;
+  guint8 extranonce[BLOCK_TEMPLATE_EXTRANONCE_SIZE];
 };
 
+static const gchar *
+get_work_data (JsonNode *work)
+{
+  if (JSON_NODE_HOLDS_OBJECT (work))
+    return json_object_get_string_member (json_node_get_object (work), "data");
+  else if (JSON_NODE_HOLDS_ARRAY (work) &&
+           json_array_get_length (json_node_get_array (work)) > 0)
+    return json_array_get_string_element (json_node_get_array (work), 0);
+  else
+    return NULL;
+}
+
+/* 'work' is the putwork params, only read during the call */
 WorkResult *
 work_result_new (JsonNode *work, guint invocation_id, EvdHttpConnection *conn)
 {
   WorkResult *self;
+  const gchar *data;
 
-  self = g_slice_new (WorkResult);
+  self = g_slice_new0 (WorkResult);
   self->ref_count = 1;
 
-  self->work = work;
+  data = get_work_data (work);
+  if (data != NULL && strlen (data) == BLOCK_TEMPLATE_WORK_DATA_SIZE)
+    self->header_valid = block_template_work_data_to_header (data, self->header);
+
   self->invocation_id = invocation_id;
 
-  self->conn = conn;
+  self->conn = EVD_CONNECTION (conn);
   g_object_ref (conn);
 
   self->req = evd_http_connection_get_current_request (conn);
+  if (self->req != NULL)
+    evd_http_request_get_basic_auth_credentials (self->req,
+                                                 &self->user,
+                                                 &self->passw);
+
+  return self;
+}
+
+WorkResult *
+work_result_new_with_client_info (const guint8  *header,
+                                  guint          invocation_id,
+                                  EvdConnection *conn,
+                                  const gchar   *user,
+                                  const gchar   *password,
+                                  const gchar   *user_agent)
+{
+  WorkResult *self;
+
+  self = g_slice_new0 (WorkResult);
+  self->ref_count = 1;
+
+  memcpy (self->header, header, BLOCK_TEMPLATE_HEADER_SIZE);
+  self->header_valid = TRUE;
+
+  self->invocation_id = invocation_id;
+
+  self->conn = conn;
+  g_object_ref (conn);
+
+  self->user = g_strdup (user);
+  self->passw = g_strdup (password);
+  self->user_agent = g_strdup (user_agent);
 
   return self;
 }
@@ -55,9 +118,15 @@ work_result_new (JsonNode *work, guint invocation_id, EvdHttpConnection *conn)
 static void
 work_result_free (WorkResult *self)
 {
-  json_node_free (self->work);
   g_object_unref (self->conn);
 
+  g_free (self->user);
+  g_free (self->passw);
+  g_free (self->user_agent);
+
+  if (self->block_template != NULL)
+    block_template_unref (self->block_template);
+
   g_slice_free (WorkResult, self);
 }
 
@@ -87,10 +156,17 @@ work_result_unref (WorkResult *self)
     work_result_free (self);
 }
 
-JsonNode *
-work_result_get_json_node (WorkResult *self)
+/* the 80 bytes block header, or NULL if the submitted data was invalid */
+const guint8 *
+work_result_get_header (WorkResult *self)
 {
-  return self->work;
+  return self->header_valid ? self->header : NULL;
+}
+
+const gchar *
+work_result_get_user (WorkResult *self)
+{
+  return self->user;
 }
 
 guint
@@ -99,7 +175,7 @@ work_result_get_invocation_id (WorkResult *self)
   return self->invocation_id;
 }
 
-EvdHttpConnection *
+EvdConnection *
 work_result_get_connection (WorkResult *self)
 {
   return self->conn;
@@ -114,7 +190,11 @@ work_result_get_client_info (WorkResult  *self,
 {
   /* get user */
   if (user != NULL)
-    evd_http_request_get_basic_auth_credentials (self->req, user, password);
+    {
+      *user = g_strdup (self->user);
+      if (password != NULL)
+        *password = g_strdup (self->passw);
+    }
 
   /* get remote address */
   if (remote_addr != NULL)
@@ -126,10 +206,17 @@ work_result_get_client_info (WorkResult  *self,
   /* get user agent */
   if (user_agent != NULL)
     {
-      SoupMessageHeaders *headers;
+      if (self->req != NULL)
+        {
+          SoupMessageHeaders *headers;
 
-      headers = evd_http_message_get_headers (EVD_HTTP_MESSAGE (self->req));
-      *user_agent = g_strdup (soup_message_headers_get_one (headers, "User-Agent"));
+          headers = evd_http_message_get_headers (EVD_HTTP_MESSAGE (self->req));
+          *user_agent = g_strdup (soup_message_headers_get_one (headers, "User-Agent"));
+        }
+      else
+        {
+          *user_agent = g_strdup (self->user_agent);
+        }
     }
 }
 
@@ -144,3 +231,51 @@ work_result_is_stale (WorkResult *self)
 {
   return self->stale;
 }
+
+void
+work_result_set_difficulty (WorkResult *self, gdouble difficulty)
+{
+  self->difficulty = difficulty;
+}
+
+gdouble
+work_result_get_difficulty (WorkResult *self)
+{
+  return self->difficulty;
+}
+
+void
+work_result_mark_block_candidate (WorkResult *self)
+{
+  self->block_candidate = TRUE;
+}
+
+gboolean
+work_result_is_block_candidate (WorkResult *self)
+{
+  return self->block_candidate;
+}
+
+void
+work_result_set_block_template (WorkResult    *self,
+                                BlockTemplate *block_template,
+                                const guint8  *extranonce)
+{
+  if (self->block_template != NULL)
+    block_template_unref (self->block_template);
+
+  self->block_template = block_template_ref (block_template);
+  memcpy (self->extranonce, extranonce, BLOCK_TEMPLATE_EXTRANONCE_SIZE);
+}
+
+BlockTemplate *
+work_result_get_block_template (WorkResult *self)
+{
+  return self->block_template;
+}
+
+const guint8 *
+work_result_get_extranonce (WorkResult *self)
+{
+  return self->extranonce;
+}
@@ -26,6 +26,8 @@
 
 #include <evd.h>
 
+#include "block-template.h"
+
 G_BEGIN_DECLS
 
 typedef struct _WorkResult WorkResult;
@@ -33,12 +35,19 @@ typedef struct _WorkResult WorkResult;
 WorkResult *        work_result_new                        (JsonNode          *work,
                                                             guint              invocation_id,
                                                             EvdHttpConnection *conn);
+WorkResult *        work_result_new_with_client_info       (const guint8  *header,
+                                                            guint          invocation_id,
+                                                            EvdConnection *conn,
+                                                            const gchar   *user,
+                                                            const gchar   *password,
+                                                            const gchar   *user_agent);
 WorkResult *        work_result_ref                        (WorkResult *self);
 void                work_result_unref                      (WorkResult *self);
 
-JsonNode *          work_result_get_json_node              (WorkResult *self);
+const guint8 *      work_result_get_header                 (WorkResult *self);
+const gchar *       work_result_get_user                   (WorkResult *self);
 guint               work_result_get_invocation_id          (WorkResult *self);
-EvdHttpConnection * work_result_get_connection             (WorkResult *self);
+EvdConnection *     work_result_get_connection             (WorkResult *self);
 
 void                work_result_get_client_info            (WorkResult  *self,
                                                             gchar      **user,
@@ -46,8 +55,21 @@ void                work_result_get_client_info            (WorkResult  *self,
                                                             gchar      **remote_addr,
                                                             gchar      **user_agent);
 
-void                work_result_mark_stale                  (WorkResult *self);
-gboolean            work_result_is_stale                    (WorkResult *self);
+void                work_result_mark_stale                 (WorkResult *self);
+gboolean            work_result_is_stale                   (WorkResult *self);
+
+void                work_result_set_difficulty             (WorkResult *self,
+                                                            gdouble     difficulty);
+gdouble             work_result_get_difficulty             (WorkResult *self);
+
+void                work_result_mark_block_candidate       (WorkResult *self);
+gboolean            work_result_is_block_candidate         (WorkResult *self);
+
+void                work_result_set_block_template         (WorkResult    *self,
+                                                            BlockTemplate *block_template,
+                                                            const guint8  *extranonce);
+BlockTemplate *     work_result_get_block_template         (WorkResult    *self);
+const guint8 *      work_result_get_extranonce             (WorkResult    *self);
 
 G_END_DECLS
 
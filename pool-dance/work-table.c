@@ -0,0 +1,447 @@
+/*
+ * work-table.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include <string.h>
+
+#include "work-table.h"
+#include "sha256d.h"
+
+/* slots are handed out from fixed-size chunks, and referred to by index
+   from the open-addressing index */
+#define SLAB_CHUNK_SLOTS 4096
+
+#define INITIAL_INDEX_SIZE 1024
+
+#define NONCE_SET_INITIAL_BITS 5
+
+/* everything else a table needs is carved out of blocks this size, and
+   only released when the whole table is */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct _WorkTable
+{
+  GPtrArray *chunks;
+  guint slots_used;
+
+  /* slot number + 1, or 0 when empty; size is a power of two */
+  guint32 *index;
+  guint index_size;
+
+  GStringChunk *strings;
+
+  GPtrArray *arena_blocks;
+  guint8 *arena_pos;
+  gsize arena_left;
+
+  /* one reference per distinct template, slots just point to them */
+  GPtrArray *templates;
+};
+
+/* open-addressing set of nonces, for work items getting more shares
+   than fit in the slot; 0 marks empty positions so it is kept apart */
+struct _WorkNonceSet
+{
+  guint32 *slots;
+  guint bits;
+  guint count;
+  gboolean has_zero;
+};
+
+static TrackedWork *
+get_slot (WorkTable *self, guint32 slot)
+{
+  TrackedWork *chunk;
+
+  chunk = g_ptr_array_index (self->chunks, slot / SLAB_CHUNK_SLOTS);
+
+  return &chunk[slot % SLAB_CHUNK_SLOTS];
+}
+
+static const guint8 *
+slot_get_merkle_root (TrackedWork *tracked_work)
+{
+  return tracked_work->header + WORK_TABLE_MERKLE_ROOT_OFFSET;
+}
+
+static gpointer
+arena_alloc0 (WorkTable *self, gsize size)
+{
+  gpointer mem;
+
+  size = (size + 7) & ~((gsize) 7);
+
+  if (size > self->arena_left)
+    {
+      gsize block_size = MAX (ARENA_BLOCK_SIZE, size);
+
+      self->arena_pos = g_malloc0 (block_size);
+      self->arena_left = block_size;
+      g_ptr_array_add (self->arena_blocks, self->arena_pos);
+    }
+
+  mem = self->arena_pos;
+  self->arena_pos += size;
+  self->arena_left -= size;
+
+  return mem;
+}
+
+/* merkle roots are hashes already, any 32 bits of them will do */
+static guint
+merkle_root_hash (const guint8 *merkle_root)
+{
+  guint32 value;
+
+  memcpy (&value, merkle_root, sizeof (value));
+
+  return value;
+}
+
+/* returns the index position holding 'merkle_root', or the empty one
+   where it would go */
+static guint
+find_position (WorkTable *self, const guint8 *merkle_root)
+{
+  guint mask = self->index_size - 1;
+  guint pos;
+
+  pos = merkle_root_hash (merkle_root) & mask;
+  while (self->index[pos] != 0)
+    {
+      TrackedWork *tracked_work;
+
+      tracked_work = get_slot (self, self->index[pos] - 1);
+      if (memcmp (slot_get_merkle_root (tracked_work), merkle_root, 32) == 0)
+        break;
+
+      pos = (pos + 1) & mask;
+    }
+
+  return pos;
+}
+
+static void
+grow_index (WorkTable *self)
+{
+  guint32 *old_index = self->index;
+  guint old_size = self->index_size;
+  guint i;
+
+  self->index_size *= 2;
+  self->index = g_new0 (guint32, self->index_size);
+
+  for (i=0; i<old_size; i++)
+    if (old_index[i] != 0)
+      {
+        TrackedWork *tracked_work;
+        guint pos;
+
+        tracked_work = get_slot (self, old_index[i] - 1);
+        pos = find_position (self, slot_get_merkle_root (tracked_work));
+        self->index[pos] = old_index[i];
+      }
+
+  g_free (old_index);
+}
+
+static guint32
+alloc_slot (WorkTable *self)
+{
+  if (self->slots_used % SLAB_CHUNK_SLOTS == 0)
+    g_ptr_array_add (self->chunks, g_new0 (TrackedWork, SLAB_CHUNK_SLOTS));
+
+  return self->slots_used++;
+}
+
+/* nonces are often sequential or strided, take the high bits of a
+   multiplicative hash to spread them */
+static guint
+nonce_set_position (WorkNonceSet *set, guint32 nonce)
+{
+  return (guint32) (nonce * 2654435761U) >> (32 - set->bits);
+}
+
+static gboolean
+nonce_set_insert (WorkNonceSet *set, guint32 nonce)
+{
+  guint mask = (1 << set->bits) - 1;
+  guint pos;
+
+  if (nonce == 0)
+    {
+      if (set->has_zero)
+        return FALSE;
+
+      set->has_zero = TRUE;
+      return TRUE;
+    }
+
+  pos = nonce_set_position (set, nonce);
+  while (set->slots[pos] != 0)
+    {
+      if (set->slots[pos] == nonce)
+        return FALSE;
+
+      pos = (pos + 1) & mask;
+    }
+
+  set->slots[pos] = nonce;
+  set->count++;
+
+  return TRUE;
+}
+
+static WorkNonceSet *
+nonce_set_new (WorkTable *self, guint bits)
+{
+  WorkNonceSet *set;
+
+  set = arena_alloc0 (self, sizeof (WorkNonceSet));
+  set->bits = bits;
+  set->slots = arena_alloc0 (self, sizeof (guint32) << bits);
+
+  return set;
+}
+
+/* the old slots stay in the arena until the table goes away, at most
+   as much again as the final size */
+static void
+nonce_set_grow (WorkTable *self, WorkNonceSet *set)
+{
+  guint32 *old_slots = set->slots;
+  guint old_size = 1 << set->bits;
+  guint i;
+
+  set->bits++;
+  set->slots = arena_alloc0 (self, sizeof (guint32) << set->bits);
+  set->count = 0;
+
+  for (i=0; i<old_size; i++)
+    if (old_slots[i] != 0)
+      nonce_set_insert (set, old_slots[i]);
+}
+
+/* binary search over the inline nonces, returns where 'nonce' is or
+   would be inserted */
+static guint
+inline_nonce_position (TrackedWork *tracked_work, guint32 nonce)
+{
+  guint low = 0;
+  guint high = tracked_work->nonce_count;
+
+  while (low < high)
+    {
+      guint mid = (low + high) / 2;
+
+      if (tracked_work->nonces[mid] < nonce)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  return low;
+}
+
+/* public methods */
+
+WorkTable *
+work_table_new (void)
+{
+  WorkTable *self;
+
+  self = g_slice_new0 (WorkTable);
+
+  self->chunks = g_ptr_array_new_with_free_func (g_free);
+
+  self->index_size = INITIAL_INDEX_SIZE;
+  self->index = g_new0 (guint32, self->index_size);
+
+  self->strings = g_string_chunk_new (1024);
+
+  self->arena_blocks = g_ptr_array_new_with_free_func (g_free);
+  self->templates =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) block_template_unref);
+
+  return self;
+}
+
+/* the cost does not depend on the number of slots, only on how many
+   chunks and arena blocks they took */
+void
+work_table_free (WorkTable *self)
+{
+  if (self == NULL)
+    return;
+
+  g_ptr_array_unref (self->chunks);
+  g_ptr_array_unref (self->arena_blocks);
+  g_ptr_array_unref (self->templates);
+  g_free (self->index);
+  g_string_chunk_free (self->strings);
+
+  g_slice_free (WorkTable, self);
+}
+
+TrackedWork *
+work_table_lookup (WorkTable *self, const guint8 *merkle_root)
+{
+  guint pos;
+
+  pos = find_position (self, merkle_root);
+  if (self->index[pos] == 0)
+    return NULL;
+
+  return get_slot (self, self->index[pos] - 1);
+}
+
+/* returns the slot of the work whose header starts with 'header', a new
+   one with the header prefix and midstate filled in if not there yet */
+TrackedWork *
+work_table_insert (WorkTable *self, const guint8 *header, gboolean *created)
+{
+  const guint8 *merkle_root = header + WORK_TABLE_MERKLE_ROOT_OFFSET;
+  TrackedWork *tracked_work;
+  guint32 slot;
+  guint pos;
+
+  pos = find_position (self, merkle_root);
+  if (self->index[pos] != 0)
+    {
+      if (created != NULL)
+        *created = FALSE;
+
+      return get_slot (self, self->index[pos] - 1);
+    }
+
+  slot = alloc_slot (self);
+  tracked_work = get_slot (self, slot);
+
+  memcpy (tracked_work->header, header, WORK_TABLE_HEADER_PREFIX_SIZE);
+  sha256d_midstate (header, tracked_work->midstate);
+
+  self->index[pos] = slot + 1;
+
+  /* keep the load factor under 3/4 */
+  if (self->slots_used * 4 > self->index_size * 3)
+    grow_index (self);
+
+  if (created != NULL)
+    *created = TRUE;
+
+  return tracked_work;
+}
+
+/* records a nonce found on 'tracked_work', returns FALSE if it was
+   already there */
+gboolean
+work_table_add_nonce (WorkTable   *self,
+                      TrackedWork *tracked_work,
+                      guint32      nonce)
+{
+  WorkNonceSet *set = tracked_work->nonce_set;
+  guint pos;
+  guint i;
+
+  if (set == NULL)
+    {
+      pos = inline_nonce_position (tracked_work, nonce);
+      if (pos < tracked_work->nonce_count && tracked_work->nonces[pos] == nonce)
+        return FALSE;
+
+      if (tracked_work->nonce_count < WORK_TABLE_NONCE_INLINE)
+        {
+          memmove (tracked_work->nonces + pos + 1,
+                   tracked_work->nonces + pos,
+                   (tracked_work->nonce_count - pos) * sizeof (guint32));
+          tracked_work->nonces[pos] = nonce;
+          tracked_work->nonce_count++;
+
+          return TRUE;
+        }
+
+      /* out of room, move them all to a set */
+      set = nonce_set_new (self, NONCE_SET_INITIAL_BITS);
+      for (i=0; i<tracked_work->nonce_count; i++)
+        nonce_set_insert (set, tracked_work->nonces[i]);
+
+      tracked_work->nonce_set = set;
+    }
+
+  if (! nonce_set_insert (set, nonce))
+    return FALSE;
+
+  tracked_work->nonce_count++;
+
+  /* keep the load factor under 1/2 */
+  if (set->count * 2 > (1U << set->bits))
+    nonce_set_grow (self, set);
+
+  return TRUE;
+}
+
+void
+work_table_clear_nonces (WorkTable *self, TrackedWork *tracked_work)
+{
+  tracked_work->nonce_set = NULL;
+  tracked_work->nonce_count = 0;
+}
+
+void
+work_table_set_block_template (WorkTable     *self,
+                               TrackedWork   *tracked_work,
+                               BlockTemplate *block_template,
+                               const guint8  *extranonce)
+{
+  gint i;
+
+  tracked_work->block_template = block_template;
+  if (block_template == NULL)
+    return;
+
+  memcpy (tracked_work->extranonce,
+          extranonce,
+          BLOCK_TEMPLATE_EXTRANONCE_SIZE);
+
+  /* few templates per block, and mostly the latest one */
+  for (i=self->templates->len - 1; i>=0; i--)
+    if (g_ptr_array_index (self->templates, i) == block_template)
+      return;
+
+  g_ptr_array_add (self->templates, block_template_ref (block_template));
+}
+
+/* strings live as long as the table, and are shared when equal */
+const gchar *
+work_table_intern (WorkTable *self, const gchar *str)
+{
+  if (str == NULL)
+    return NULL;
+
+  return g_string_chunk_insert_const (self->strings, str);
+}
+
+guint
+work_table_get_size (WorkTable *self)
+{
+  return self->slots_used;
+}
@@ -0,0 +1,91 @@
+/*
+ * work-table.h
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#ifndef __WORK_TABLE_H__
+#define __WORK_TABLE_H__
+
+#include <glib.h>
+
+#include "block-template.h"
+
+G_BEGIN_DECLS
+
+/* nonces kept sorted inside the slot, before moving to a hash set */
+#define WORK_TABLE_NONCE_INLINE 8
+
+/* header bytes shared by every share of a work item: version, previous
+   block hash and merkle root */
+#define WORK_TABLE_HEADER_PREFIX_SIZE 68
+#define WORK_TABLE_MERKLE_ROOT_OFFSET 36
+
+typedef struct _WorkTable WorkTable;
+typedef struct _WorkNonceSet WorkNonceSet;
+
+typedef struct
+{
+  guint8 header[WORK_TABLE_HEADER_PREFIX_SIZE];
+  guint32 midstate[8];
+
+  /* block times accepted in shares, a single one unless miners may
+     roll it */
+  guint32 timestamp;
+  guint32 timestamp_max;
+  const gchar *user;
+
+  /* owned by the table */
+  BlockTemplate *block_template;
+  guint8 extranonce[BLOCK_TEMPLATE_EXTRANONCE_SIZE];
+
+  guint nonce_count;
+  guint32 nonces[WORK_TABLE_NONCE_INLINE];
+  WorkNonceSet *nonce_set;
+} TrackedWork;
+
+WorkTable *     work_table_new                (void);
+void            work_table_free               (WorkTable *self);
+
+TrackedWork *   work_table_lookup             (WorkTable    *self,
+                                               const guint8 *merkle_root);
+TrackedWork *   work_table_insert             (WorkTable    *self,
+                                               const guint8 *header,
+                                               gboolean     *created);
+
+gboolean        work_table_add_nonce          (WorkTable   *self,
+                                               TrackedWork *tracked_work,
+                                               guint32      nonce);
+void            work_table_clear_nonces       (WorkTable   *self,
+                                               TrackedWork *tracked_work);
+
+void            work_table_set_block_template (WorkTable     *self,
+                                               TrackedWork   *tracked_work,
+                                               BlockTemplate *block_template,
+                                               const guint8  *extranonce);
+
+const gchar *   work_table_intern             (WorkTable   *self,
+                                               const gchar *str);
+
+guint           work_table_get_size           (WorkTable *self);
+
+G_END_DECLS
+
+#endif /* __WORK_TABLE_H__ */
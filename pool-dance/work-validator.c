@@ -21,128 +21,409 @@
  * for more details.
  */
 
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include "work-validator.h"
+#include "sha256d.h"
+#include "work-table.h"
+#include "hex-codec.h"
+
+#define CONFIG_GROUP_NAME "work-validator"
+
+#define DEFAULT_QUEUE_DEPTH 4096
+
+/* most shares a worker takes from the queue and hashes together */
+#define VALIDATE_BATCH_MAX 16
 
-#define TRACK_NONCE_MAX 16
+/* how many shares can be hashed on the main loop per time window,
+   before falling back to the thread pool */
+#define INLINE_WINDOW_USEC 10000
+#define INLINE_MAX_PER_WINDOW 64
+
+typedef struct _ValidationJob ValidationJob;
 
 struct _WorkValidator
 {
   GMainContext *context;
-  EvdJsonrpcHttpClient *rpc;
 
-  GThreadPool *thread_pool;
+  WorkValidatorVerdictCb callback;
+  gpointer user_data;
 
-  GHashTable *work_by_merkle_root;
-  GHashTable *work_by_merkle_root_prev;
+  /* jobs are recycled, only touched from the main loop */
+  ValidationJob *free_jobs;
 
-  guint block_num;
-  gchar *block_hash;
-  gchar *block_hash_prev;
+  /* jobs waiting for a worker, oldest first */
+  GThreadPool *thread_pool;
+  GMutex pending_lock;
+  ValidationJob *pending_head;
+  ValidationJob *pending_tail;
+  guint pending_len;
+  guint queue_depth;
+
+  gint *cpus;
+  guint cpus_len;
+  gint next_cpu;
+
+  /* jobs validated by the workers, pushed lock-free and signalled
+     through 'completed_fd' when the stack stops being empty */
+  gpointer completed;
+  gint completed_fd;
+  GSource *completed_src;
+
+  gint64 inline_window_start;
+  guint inline_count;
+
+  /* tracked work of the current and previous blocks; older ones are
+     freed by 'reclaimer', away from the main loop */
+  WorkTable *work_table;
+  WorkTable *work_table_prev;
+  GThreadPool *reclaimer;
+
+  /* previous block hash expected in work headers, in header order */
+  guint8 block_hash[32];
+  guint8 block_hash_prev[32];
+  gboolean has_block_hash;
+  gboolean has_block_hash_prev;
+
+  /* shares on top of a block the validator does not know yet, which
+     means miners got work for it before the block change got here */
+  guint not_ready_shares;
+  gint64 not_ready_since;
+  guint last_not_ready_shares;
+  gint64 last_not_ready_time;
 
   guint8 target[32];
 };
 
-typedef struct
+struct _ValidationJob
 {
-  UpstreamService *upstream_service;
-  gchar *user;
+  ValidationJob *next;
 
-  guchar version[8];
-  guchar timestamp[8];
+  WorkResult *work_result;
+  WorkValidatorError verdict;
+  const gchar *reason;
+
+  /* SHA-256 state after the first 64 bytes of the tracked work header,
+     which are the same for every share of it */
+  gboolean has_midstate;
+  guint8 header_head[64];
+  guint32 midstate[8];
 
-  guint nonce_count;
-  guint32 nonces[TRACK_NONCE_MAX];
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+  guint8 hash[32];
+};
 
-  gboolean possible_stale;
-} TrackedWork;
 
+static void validate_work_batch_in_thread  (gpointer       data,
+                                            WorkValidator *self);
+static void validate_job_in_place          (WorkValidator *self,
+                                            ValidationJob *job);
 
-static void resolve_current_block_hash     (WorkValidator *self);
-static void validate_work_result_in_thread (GSimpleAsyncResult *res,
-                                            WorkValidator      *self);
+static ValidationJob *
+validation_job_new (WorkValidator *self, WorkResult *work_result)
+{
+  ValidationJob *job;
+
+  if (self->free_jobs != NULL)
+    {
+      job = self->free_jobs;
+      self->free_jobs = job->next;
+    }
+  else
+    {
+      job = g_slice_new (ValidationJob);
+    }
+
+  job->next = NULL;
+  job->work_result = work_result_ref (work_result);
+  job->verdict = WORK_VALIDATOR_ERROR_SUCCESS;
+  job->reason = NULL;
+  job->has_midstate = FALSE;
+
+  return job;
+}
 
 static void
-tracked_work_free (TrackedWork *data)
+validation_job_free (ValidationJob *job)
 {
-  g_free (data->user);
+  g_slice_free (ValidationJob, job);
+}
 
-  g_slice_free (TrackedWork, data);
+/* hands the verdict to the callback, and keeps the job for reuse */
+static void
+report_verdict (WorkValidator *self, ValidationJob *job)
+{
+  self->callback (self,
+                  job->work_result,
+                  job->verdict,
+                  job->reason,
+                  self->user_data);
+
+  work_result_unref (job->work_result);
+  job->work_result = NULL;
+
+  job->next = self->free_jobs;
+  self->free_jobs = job;
 }
 
-static gboolean
-on_work_validated (gpointer user_data)
+static GPrivate worker_pinned = G_PRIVATE_INIT (NULL);
+
+/* moves the calling worker to the next CPU of the configured set, once */
+static void
+pin_worker_thread (WorkValidator *self)
 {
-  GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+#ifdef __linux__
+  cpu_set_t set;
+  gint cpu;
+
+  if (self->cpus_len == 0 || g_private_get (&worker_pinned) != NULL)
+    return;
 
-  g_simple_async_result_complete_in_idle (res);
-  g_object_unref (res);
+  g_private_set (&worker_pinned, GINT_TO_POINTER (TRUE));
 
-  return FALSE;
+  cpu = self->cpus[(g_atomic_int_add (&self->next_cpu, 1)) % self->cpus_len];
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  if (sched_setaffinity (0, sizeof (set), &set) != 0)
+    g_print ("Failed to pin validator thread to CPU %d\n", cpu);
+#endif
 }
 
+/* called from workers with a chain of jobs linked newest first, the
+   main loop is only woken up for the first chain that lands on an
+   empty stack */
 static void
-swap_hex_bytes2 (gchar *hex, goffset from, gsize len)
+push_completed_jobs (WorkValidator *self,
+                     ValidationJob *newest,
+                     ValidationJob *oldest)
 {
-  gint i;
-  gchar t[2];
-  goffset head = from * 2;
-  goffset tail = head + len * 2 - 2;
+  gpointer head;
+  guint64 one = 1;
+
+  do
+    {
+      head = g_atomic_pointer_get (&self->completed);
+      oldest->next = head;
+    }
+  while (! g_atomic_pointer_compare_and_exchange (&self->completed,
+                                                  head,
+                                                  newest));
+
+  if (head == NULL && write (self->completed_fd, &one, sizeof (one)) < 0)
+    g_print ("Failed to signal validated work: %s\n", g_strerror (errno));
+}
+
+static ValidationJob *
+pop_completed_jobs (WorkValidator *self)
+{
+  ValidationJob *head;
+  ValidationJob *list = NULL;
+  ValidationJob *next;
+
+  do
+    {
+      head = g_atomic_pointer_get (&self->completed);
+    }
+  while (! g_atomic_pointer_compare_and_exchange (&self->completed,
+                                                  head,
+                                                  NULL));
 
-  for (i=0; i<len/2; i++)
+  /* the stack is LIFO, give back jobs in the order they were done */
+  while (head != NULL)
     {
-      memcpy (t, hex + head + i*2, 2);
-      memcpy (hex + head + i*2, hex + tail - i*2, 2);
-      memcpy (hex + tail - i*2, t, 2);
+      next = head->next;
+      head->next = list;
+      list = head;
+      head = next;
     }
+
+  return list;
 }
 
 static gboolean
-hex_to_bin (const gchar *hex, gsize hex_size, guint8 *bin, GError **error)
+on_work_batches_validated (GIOChannel   *channel,
+                           GIOCondition  condition,
+                           gpointer      user_data)
 {
-  gchar byte[3] = {0, };
-  gint i;
-  gchar *endptr;
+  WorkValidator *self = user_data;
+  ValidationJob *job;
+  ValidationJob *next;
+  guint64 count;
+
+  /* reset the counter before taking the stack, so that a job pushed
+     right after is signalled again */
+  if (read (self->completed_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    g_print ("Failed to read validated work signal: %s\n", g_strerror (errno));
 
-  for (i=0; i<hex_size/2; i++)
+  job = pop_completed_jobs (self);
+  while (job != NULL)
     {
-      memcpy (byte, hex + i*2, 2);
-      bin[i] = strtoul (byte, &endptr, 16);
-      if (endptr != byte + 2)
+      next = job->next;
+      report_verdict (self, job);
+      job = next;
+    }
+
+  return TRUE;
+}
+
+/* the CPU quota of the cgroup we run in, or -1 if unlimited */
+static gint
+get_cgroup_cpu_limit (void)
+{
+  gchar *contents = NULL;
+  gint64 quota = -1;
+  gint64 period = 0;
+
+  /* cgroup v2 */
+  if (g_file_get_contents ("/sys/fs/cgroup/cpu.max", &contents, NULL, NULL))
+    {
+      if (! g_str_has_prefix (contents, "max"))
+        sscanf (contents, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+                &quota,
+                &period);
+      g_free (contents);
+    }
+  /* cgroup v1 */
+  else if (g_file_get_contents ("/sys/fs/cgroup/cpu/cpu.cfs_quota_us",
+                                &contents,
+                                NULL,
+                                NULL))
+    {
+      quota = g_ascii_strtoll (contents, NULL, 10);
+      g_free (contents);
+
+      if (g_file_get_contents ("/sys/fs/cgroup/cpu/cpu.cfs_period_us",
+                               &contents,
+                               NULL,
+                               NULL))
         {
-          g_set_error (error,
-                       WORK_VALIDATOR_ERROR,
-                       WORK_VALIDATOR_ERROR_INVALID,
-                       "Invalid hex string");
-          return FALSE;
+          period = g_ascii_strtoll (contents, NULL, 10);
+          g_free (contents);
         }
     }
 
-  return TRUE;
+  if (quota <= 0 || period <= 0)
+    return -1;
+
+  return MAX (1, (quota + period - 1) / period);
+}
+
+static gint
+get_auto_thread_count (void)
+{
+  gint cpus;
+  gint limit;
+
+  cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+
+  limit = get_cgroup_cpu_limit ();
+  if (limit > 0 && limit < cpus)
+    cpus = limit;
+
+  return cpus;
 }
 
 WorkValidator *
-work_validator_new (EvdJsonrpcHttpClient *rpc)
+work_validator_new (GKeyFile                *config,
+                    WorkValidatorVerdictCb   callback,
+                    gpointer                 user_data,
+                    GError                 **error)
 {
   WorkValidator *self;
+  gchar *threads_str;
+  gint threads;
+  gint queue_depth;
+  GIOChannel *channel;
+  gsize cpus_len = 0;
+
+  /* worker threads, 'auto' is one per available CPU */
+  threads_str = g_key_file_get_string (config,
+                                       CONFIG_GROUP_NAME,
+                                       "threads",
+                                       NULL);
+  if (threads_str == NULL || g_strcmp0 (threads_str, "auto") == 0)
+    threads = get_auto_thread_count ();
+  else
+    threads = (gint) g_ascii_strtoll (threads_str, NULL, 10);
+  g_free (threads_str);
+
+  if (threads < 1)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid number of validator threads");
+      return NULL;
+    }
+
+  queue_depth = g_key_file_get_integer (config,
+                                        CONFIG_GROUP_NAME,
+                                        "queue-depth",
+                                        NULL);
+  if (queue_depth <= 0)
+    queue_depth = DEFAULT_QUEUE_DEPTH;
 
   self = g_slice_new0 (WorkValidator);
 
+  self->cpus = g_key_file_get_integer_list (config,
+                                            CONFIG_GROUP_NAME,
+                                            "cpu-affinity",
+                                            &cpus_len,
+                                            NULL);
+  self->cpus_len = cpus_len;
+  self->queue_depth = queue_depth;
+
+  self->callback = callback;
+  self->user_data = user_data;
+
   self->context = g_main_context_get_thread_default ();
 
-  self->rpc = rpc;
-  g_object_ref (rpc);
+  self->completed_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (self->completed_fd < 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errno),
+                   "Failed to create validator eventfd: %s",
+                   g_strerror (errno));
+      g_free (self->cpus);
+      g_slice_free (WorkValidator, self);
+      return NULL;
+    }
 
-  self->thread_pool = g_thread_pool_new ((GFunc) validate_work_result_in_thread,
+  channel = g_io_channel_unix_new (self->completed_fd);
+  self->completed_src = g_io_create_watch (channel, G_IO_IN);
+  g_source_set_callback (self->completed_src,
+                         (GSourceFunc) on_work_batches_validated,
+                         self,
+                         NULL);
+  g_source_attach (self->completed_src, self->context);
+  g_io_channel_unref (channel);
+
+  /* exclusive threads, so that pinning them sticks */
+  g_mutex_init (&self->pending_lock);
+  self->thread_pool = g_thread_pool_new ((GFunc) validate_work_batch_in_thread,
                                          self,
-                                         4,
-                                         FALSE,
+                                         threads,
+                                         self->cpus_len > 0,
                                          NULL);
 
-  self->work_by_merkle_root =
-    g_hash_table_new_full (g_str_hash,
-                           g_str_equal,
-                           g_free,
-                           (GDestroyNotify) tracked_work_free);
+  self->work_table = work_table_new ();
+  self->reclaimer = g_thread_pool_new ((GFunc) work_table_free,
+                                       NULL,
+                                       1,
+                                       FALSE,
+                                       NULL);
 
   return self;
 }
@@ -150,487 +431,604 @@ work_validator_new (EvdJsonrpcHttpClient *rpc)
 void
 work_validator_free (WorkValidator *self)
 {
+  ValidationJob *job;
+
   if (self == NULL)
     return;
 
-  g_object_unref (self->rpc);
-  g_thread_pool_free (self->thread_pool, TRUE, FALSE);
-  g_hash_table_unref (self->work_by_merkle_root);
-  if (self->work_by_merkle_root_prev != NULL)
-    g_hash_table_unref (self->work_by_merkle_root_prev);
-  g_free (self->block_hash);
-  g_free (self->block_hash_prev);
+  /* let workers finish what they hold, they use 'self' until then */
+  g_thread_pool_free (self->thread_pool, FALSE, TRUE);
+
+  /* validated but never reported back */
+  on_work_batches_validated (NULL, G_IO_IN, self);
+
+  /* queued after the last drain started, validate them in place */
+  while (self->pending_head != NULL)
+    {
+      job = self->pending_head;
+      self->pending_head = job->next;
+
+      validate_job_in_place (self, job);
+    }
+  self->pending_tail = NULL;
+  self->pending_len = 0;
 
+  g_mutex_clear (&self->pending_lock);
+
+  while (self->free_jobs != NULL)
+    {
+      job = self->free_jobs;
+
+      self->free_jobs = job->next;
+      validation_job_free (job);
+    }
+
+  g_source_destroy (self->completed_src);
+  g_source_unref (self->completed_src);
+  close (self->completed_fd);
+  g_free (self->cpus);
+  g_thread_pool_free (self->reclaimer, FALSE, TRUE);
+  work_table_free (self->work_table);
+  work_table_free (self->work_table_prev);
   g_slice_free (WorkValidator, self);
 }
 
-static gchar *
+static const gchar *
 work_item_get_data_hex (JsonNode *work_item)
 {
-  const gchar *data;
-
   if (JSON_NODE_HOLDS_OBJECT (work_item))
     {
       JsonObject *obj;
 
       obj = json_node_get_object (work_item);
-      data = json_object_get_string_member (obj, "data");
+      return json_object_get_string_member (obj, "data");
     }
   else
     {
       JsonArray *arr;
 
       arr = json_node_get_array (work_item);
-      data = json_array_get_string_element (arr, 0);
+      return json_array_get_string_element (arr, 0);
     }
-
-  return g_strdup (data);
-}
-
-static gchar *
-work_data_get_merkle_root_hex (const gchar *data)
-{
-  gchar merkle_root[65] = {0, };
-
-  memcpy (merkle_root, data + 72, 64);
-
-  return g_strdup (merkle_root);
 }
 
 static guint32
-work_data_get_nonce (const gchar *data)
+header_get_uint32 (const guint8 *header, goffset offset)
 {
-  gchar nonce_str[9] = {0, };
-  guint32 nonce;
+  guint32 value;
 
-  memcpy (nonce_str, data + 152, 8);
-  nonce = (guint32) g_ascii_strtoull (nonce_str, NULL, 16);
+  memcpy (&value, header + offset, sizeof (value));
 
-  return GUINT32_SWAP_LE_BE (nonce);
+  return GUINT32_FROM_LE (value);
 }
 
 static TrackedWork *
-get_tracked_work_by_data (WorkValidator  *self,
-                          const gchar    *data,
-                          GError        **error)
+get_tracked_work_by_header (WorkValidator *self,
+                            const guint8  *header,
+                            gboolean      *stale)
 {
+  const guint8 *merkle_root = header + WORK_TABLE_MERKLE_ROOT_OFFSET;
   TrackedWork *tracked_work;
-  gchar *merkle_root;
 
-  merkle_root = work_data_get_merkle_root_hex (data);
+  *stale = FALSE;
 
-  tracked_work = g_hash_table_lookup (self->work_by_merkle_root, merkle_root);
-  if (tracked_work == NULL)
+  tracked_work = work_table_lookup (self->work_table, merkle_root);
+  if (tracked_work == NULL && self->work_table_prev != NULL)
     {
       /* check if it belongs to a previously tracked work */
-      tracked_work = g_hash_table_lookup (self->work_by_merkle_root_prev,
-                                          merkle_root);
-      if (tracked_work == NULL)
-        g_set_error (error,
-                     WORK_VALIDATOR_ERROR,
-                     WORK_VALIDATOR_ERROR_INVALID,
-                     "Work result for an unknown work item");
-      else
-        tracked_work->possible_stale = TRUE;
+      tracked_work = work_table_lookup (self->work_table_prev, merkle_root);
+      if (tracked_work != NULL)
+        *stale = TRUE;
     }
 
-  g_free (merkle_root);
-
   return tracked_work;
 }
 
-static gboolean
-check_merkle_root_and_nonce_is_unique (const gchar  *data,
-                                       TrackedWork  *tracked_work,
-                                       GError      **error)
+/* the quick, non-blocking part of the validation; 'reason' is left
+   pointing to a static string on failure */
+static WorkValidatorError
+prevalidate_work_result (WorkValidator *self, ValidationJob *job)
 {
-  guint32 nonce;
-  gint i;
-
-  nonce = work_data_get_nonce (data);
-
-  for (i=0; i<tracked_work->nonce_count; i++)
-    if (nonce == tracked_work->nonces[i])
-      {
-        g_set_error (error,
-                     WORK_VALIDATOR_ERROR,
-                     WORK_VALIDATOR_ERROR_DUPLICATED,
-                     "Duplicate work result");
-        return FALSE;
-      }
-
-  tracked_work->nonces[tracked_work->nonce_count] = nonce;
-  tracked_work->nonce_count++;
-
-  return TRUE;
-}
-
-static gboolean
-check_previous_block_hash_matches (const gchar  *data,
-                                   const gchar  *block_hash,
-                                   GError      **error)
-{
-  gchar prev_block_hash[65] = {0, };
-
-  memcpy (prev_block_hash, data + 8, 64);
+  WorkResult *work_result = job->work_result;
+  const guint8 *header;
+  TrackedWork *tracked_work;
+  gboolean stale;
 
-  if (g_strcmp0 (prev_block_hash, block_hash) != 0)
+  header = work_result_get_header (work_result);
+  if (header == NULL)
     {
-      g_set_error (error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_INVALID,
-                   "Previous block hash mismatch");
-      return FALSE;
+      job->reason = "Work data is invalid";
+      return WORK_VALIDATOR_ERROR_INVALID;
     }
 
-  return TRUE;
-}
+  memcpy (job->header, header, BLOCK_TEMPLATE_HEADER_SIZE);
 
-static gboolean
-prevalidate_work_result (WorkValidator *self, WorkResult *work_result, GError **error)
-{
-  TrackedWork *tracked_work;
-  gchar *data = NULL;
-  gchar *user = NULL;
-
-  data = work_item_get_data_hex (work_result_get_json_node (work_result));
-
-  /* check length */
-  if (strlen (data) != 256)
+  /* check if the merkle root has ever been sent to a miner */
+  tracked_work = get_tracked_work_by_header (self, header, &stale);
+  if (tracked_work == NULL)
     {
-      g_set_error (error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_INVALID,
-                   "Work data is invalid, incorrect length");
-      goto out;
+      job->reason = "Work result for an unknown work item";
+      return WORK_VALIDATOR_ERROR_INVALID;
+    }
+  else if (stale)
+    {
+      work_result_mark_stale (work_result);
     }
 
-  /* check if the merkle root has ever been sent to a miner */
-  tracked_work = get_tracked_work_by_data (self, data, error);
-  if (tracked_work == NULL)
-    goto out;
-  else if (tracked_work->possible_stale)
-    work_result_mark_stale (work_result);
+  /* work built out of a block template needs it back for submission */
+  if (tracked_work->block_template != NULL)
+    work_result_set_block_template (work_result,
+                                    tracked_work->block_template,
+                                    tracked_work->extranonce);
+
+  /* hand the midstate over to the validation thread, the tracked work
+     may be gone by the time it runs */
+  job->has_midstate = TRUE;
+  memcpy (job->header_head, tracked_work->header, 64);
+  memcpy (job->midstate, tracked_work->midstate, sizeof (job->midstate));
 
   /* compare version */
-  if (memcmp (tracked_work->version, data + 0, 8) != 0)
+  if (header_get_uint32 (tracked_work->header, 0) !=
+      header_get_uint32 (header, 0))
     {
-      g_set_error (error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_INVALID,
-                   "Version mismatch");
-      goto out;
+      job->reason = "Version mismatch";
+      return WORK_VALIDATOR_ERROR_INVALID;
     }
 
   /* compare timestamp */
-  if (memcmp (tracked_work->timestamp, data + 136, 8) != 0)
+  if (header_get_uint32 (header, 68) < tracked_work->timestamp ||
+      header_get_uint32 (header, 68) > tracked_work->timestamp_max)
     {
-      g_set_error (error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_INVALID,
-                   "Timestamp mismatch");
-      goto out;
+      job->reason = "Timestamp mismatch";
+      return WORK_VALIDATOR_ERROR_INVALID;
     }
 
   /* check that merkle-root + nonce is not repeated */
-  if (! check_merkle_root_and_nonce_is_unique (data, tracked_work, error))
-    goto out;
+  if (! work_table_add_nonce (stale ? self->work_table_prev : self->work_table,
+                              tracked_work,
+                              header_get_uint32 (header, 76)))
+    {
+      job->reason = "Duplicate work result";
+      return WORK_VALIDATOR_ERROR_DUPLICATED;
+    }
 
   /* compare users */
-  work_result_get_client_info (work_result, &user, NULL, NULL, NULL);
-  if (g_strcmp0 (tracked_work->user, user) != 0)
+  if (g_strcmp0 (tracked_work->user, work_result_get_user (work_result)) != 0)
     {
-      g_set_error (error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_INVALID,
-                   "User mismatch");
-      goto out;
+      job->reason = "User mismatch";
+      return WORK_VALIDATOR_ERROR_INVALID;
     }
 
   /* check previous block hash matches */
-  if ( (! tracked_work->possible_stale &&
-        ! check_previous_block_hash_matches (data, self->block_hash, error)) ||
-       (tracked_work->possible_stale &&
-        ! check_previous_block_hash_matches (data, self->block_hash_prev, error)) )
+  if ( (! stale &&
+        (! self->has_block_hash ||
+         memcmp (header + 4, self->block_hash, 32) != 0)) ||
+       (stale &&
+        (! self->has_block_hash_prev ||
+         memcmp (header + 4, self->block_hash_prev, 32) != 0)) )
     {
-      goto out;
-    }
+      if ((! self->has_block_hash ||
+           memcmp (header + 4, self->block_hash, 32) != 0) &&
+          (! self->has_block_hash_prev ||
+           memcmp (header + 4, self->block_hash_prev, 32) != 0))
+        {
+          if (self->not_ready_shares == 0)
+            self->not_ready_since = g_get_monotonic_time ();
+          self->not_ready_shares++;
+        }
 
- out:
-  g_free (user);
-  g_free (data);
+      job->reason = "Previous block hash mismatch";
+      return WORK_VALIDATOR_ERROR_INVALID;
+    }
 
-  return (*error) != NULL;
+  return WORK_VALIDATOR_ERROR_SUCCESS;
 }
 
+/* hashes are little-endian 256 bits integers, so compare them a 32 bits
+   word at a time starting from the most significant one */
 static gint
-compare_inverted_hashes (guint8 *hash1, guint8 *hash2)
+compare_inverted_hashes (const guint8 *hash1, const guint8 *hash2)
 {
+  guint32 word1;
+  guint32 word2;
   gint i;
 
-  for (i=0; i<32; i++)
-    if (hash1[32-i-1] < hash2[32-i-1])
-      return -1;
-    else if (hash1[32-i-1] > hash2[32-i-1])
-      return 1;
+  for (i=7; i>=0; i--)
+    {
+      memcpy (&word1, hash1 + i * 4, 4);
+      memcpy (&word2, hash2 + i * 4, 4);
+
+      word1 = GUINT32_FROM_LE (word1);
+      word2 = GUINT32_FROM_LE (word2);
+
+      if (word1 != word2)
+        return word1 < word2 ? -1 : 1;
+    }
 
   return 0;
 }
 
+/* expands the compact 'nBits' representation of the network target,
+   into the same little-endian layout hashes are compared in */
 static void
-validate_work_result_in_thread (GSimpleAsyncResult *res, WorkValidator *self)
+bits_to_target (guint32 bits, guint8 *target)
 {
-  WorkResult *work_result;
-  gchar *data = NULL;
-  GError *error = NULL;
-  guint8 data_bin[80];
+  gint exponent;
+  guint32 mantissa;
   gint i;
 
-  GChecksum *chksum;
-  gsize hash_len = 32;
-  guint8 hash1[32];
-  guint8 hash2[32];
-
-  work_result = g_simple_async_result_get_op_res_gpointer (res);
-
-  /* do the blocking part of the validation */
+  memset (target, 0, 32);
 
-  data = work_item_get_data_hex (work_result_get_json_node (work_result));
+  exponent = bits >> 24;
+  mantissa = bits & 0x007FFFFF;
 
-  /* remove data padding */
-  data[160] = '\0';
+  if (exponent <= 3)
+    {
+      mantissa >>= 8 * (3 - exponent);
+      exponent = 3;
+    }
 
-  /* swap each 32 bits words */
-  for (i=0; i<80; i+=4)
-    swap_hex_bytes2 (data, i, 4);
+  for (i=0; i<3; i++)
+    if (exponent - 3 + i < 32)
+      target[exponent - 3 + i] = (mantissa >> (8 * i)) & 0xFF;
+}
 
-  /* convert data to binary */
-  if (! hex_to_bin (data, 160, data_bin, &error))
-    goto out;
+/* difficulty is how many times harder than the difficulty-1 target
+   (0xffff * 2^208) the hash is */
+static gdouble
+hash_get_difficulty (guint8 *hash)
+{
+  gdouble value = 0.0;
+  gint i;
 
-  /* calculate SHA256(SHA256(data_bin)) */
-  chksum = g_checksum_new (G_CHECKSUM_SHA256);
+  for (i=31; i>=0; i--)
+    value = value * 256.0 + hash[i];
 
-  g_checksum_update (chksum, data_bin, sizeof (data_bin));
-  g_checksum_get_digest (chksum, hash1, &hash_len);
+  if (value == 0.0)
+    return HUGE_VAL;
 
-  g_checksum_reset (chksum);
+  return ldexp (0xFFFF, 208) / value;
+}
 
-  g_checksum_update (chksum, (guchar *) hash1, 32);
-  g_checksum_get_digest (chksum, hash2, &hash_len);
+/* makes sure there is a midstate for the first block of the header
+   decoded during pre-validation */
+static void
+validation_job_prepare (ValidationJob *job)
+{
+  /* the cached midstate only helps if the first block is the same */
+  if (! job->has_midstate || memcmp (job->header, job->header_head, 64) != 0)
+    {
+      sha256d_midstate (job->header, job->midstate);
+      job->has_midstate = TRUE;
+    }
+}
 
-  g_checksum_free (chksum);
+static WorkValidatorError
+validation_job_check (WorkValidator *self, ValidationJob *job)
+{
+  WorkResult *work_result = job->work_result;
+  guint8 network_target[32];
+  guint32 bits;
 
   /* compare hash with target */
-  if (compare_inverted_hashes (hash2, self->target) > 0)
+  if (compare_inverted_hashes (job->hash, self->target) > 0)
     {
-      g_set_error (&error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_INVALID,
-                   "Block hash is not less than target");
-      goto out;
+      job->reason = "Block hash is not less than target";
+      return WORK_VALIDATOR_ERROR_INVALID;
     }
 
   /* check is work result is marked as staled */
   if (work_result_is_stale (work_result))
     {
-      g_set_error (&error,
-                   WORK_VALIDATOR_ERROR,
-                   WORK_VALIDATOR_ERROR_STALE,
-                   "Block hash belongs to previous block. Stale!");
+      job->reason = "Block hash belongs to previous block. Stale!";
+      return WORK_VALIDATOR_ERROR_STALE;
     }
 
- out:
-  if (error != NULL)
-    {
-      g_simple_async_result_set_from_error (res, error);
-      g_error_free (error);
-    }
+  work_result_set_difficulty (work_result, hash_get_difficulty (job->hash));
+
+  /* only hashes meeting the network target are worth sending upstream */
+  bits = header_get_uint32 (job->header, 72);
+  bits_to_target (bits, network_target);
 
-  evd_timeout_add (self->context,
-                   0,
-                   G_PRIORITY_DEFAULT,
-                   on_work_validated,
-                   res);
+  if (compare_inverted_hashes (job->hash, network_target) <= 0)
+    work_result_mark_block_candidate (work_result);
 
-  g_free (data);
+  return WORK_VALIDATOR_ERROR_SUCCESS;
 }
 
-void
-work_validator_validate (WorkValidator       *self,
-                         WorkResult          *work_result,
-                         GCancellable        *cancellable,
-                         GAsyncReadyCallback  callback,
-                         gpointer             user_data)
+/* takes queued jobs in groups, so their hashes can be computed side by
+   side and the verdicts posted back to the main loop at once */
+static void
+validate_work_batch_in_thread (gpointer data, WorkValidator *self)
 {
-  GSimpleAsyncResult *res;
-  GError *error = NULL;
+  ValidationJob *job;
+  ValidationJob *newest;
+  ValidationJob *oldest;
 
-  res = g_simple_async_result_new (NULL,
-                                   callback,
-                                   user_data,
-                                   work_validator_validate);
+  const guint32 *midstates[VALIDATE_BATCH_MAX];
+  const guint8 *headers[VALIDATE_BATCH_MAX];
+  guint8 *hashes[VALIDATE_BATCH_MAX];
+  ValidationJob *jobs[VALIDATE_BATCH_MAX];
+  guint count;
+  guint i;
 
-  work_result_ref (work_result);
-  g_simple_async_result_set_op_res_gpointer (res,
-                                            work_result,
-                                            (GDestroyNotify) work_result_unref);
-
-  /* do a quick, non-blocking pre-validation */
-  if (! prevalidate_work_result (self, work_result, &error))
-    goto out;
+  pin_worker_thread (self);
 
- out:
-  if (error != NULL)
+  do
     {
-      g_simple_async_result_set_from_error (res, error);
-      g_error_free (error);
+      count = 0;
+
+      g_mutex_lock (&self->pending_lock);
+      while (count < VALIDATE_BATCH_MAX && self->pending_head != NULL)
+        {
+          job = self->pending_head;
+          self->pending_head = job->next;
+          self->pending_len--;
+
+          jobs[count] = job;
+          count++;
+        }
+      if (self->pending_head == NULL)
+        self->pending_tail = NULL;
+      g_mutex_unlock (&self->pending_lock);
 
-      g_simple_async_result_complete_in_idle (res);
-      g_object_unref (res);
+      if (count == 0)
+        break;
+
+      for (i=0; i<count; i++)
+        {
+          validation_job_prepare (jobs[i]);
+
+          midstates[i] = jobs[i]->midstate;
+          headers[i] = jobs[i]->header;
+          hashes[i] = jobs[i]->hash;
+        }
+
+      /* calculate SHA256(SHA256(header)) of the whole group */
+      sha256d_hash_headers_from_midstates (midstates, headers, hashes, count);
+
+      /* chain the group newest first, as the completion stack wants it */
+      newest = NULL;
+      oldest = jobs[0];
+      for (i=0; i<count; i++)
+        {
+          jobs[i]->verdict = validation_job_check (self, jobs[i]);
+          jobs[i]->next = newest;
+          newest = jobs[i];
+        }
+
+      push_completed_jobs (self, newest, oldest);
+    }
+  while (count == VALIDATE_BATCH_MAX);
+}
+
+/* hashing a single header is cheaper than handing it to a worker and
+   back, so do it in place unless shares are piling up */
+static gboolean
+can_validate_inline (WorkValidator *self)
+{
+  guint pending_len;
+  gint64 now;
+
+  g_mutex_lock (&self->pending_lock);
+  pending_len = self->pending_len;
+  g_mutex_unlock (&self->pending_lock);
+
+  /* workers are behind already, don't jump ahead of them, unless
+     the queue is full: then the main loop has to take its share, and
+     slows down reading new work meanwhile */
+  if (pending_len >= self->queue_depth)
+    return TRUE;
+  else if (pending_len > 0)
+    return FALSE;
+
+  now = g_get_monotonic_time ();
+  if (now - self->inline_window_start > INLINE_WINDOW_USEC)
+    {
+      self->inline_window_start = now;
+      self->inline_count = 0;
     }
+
+  if (self->inline_count >= INLINE_MAX_PER_WINDOW)
+    return FALSE;
+
+  self->inline_count++;
+
+  return TRUE;
+}
+
+static void
+queue_job (WorkValidator *self, ValidationJob *job)
+{
+  g_mutex_lock (&self->pending_lock);
+
+  job->next = NULL;
+  if (self->pending_tail != NULL)
+    self->pending_tail->next = job;
   else
+    self->pending_head = job;
+  self->pending_tail = job;
+  self->pending_len++;
+
+  g_mutex_unlock (&self->pending_lock);
+
+  /* it is enough to have as many drains scheduled as workers, since
+     each one empties the queue before returning */
+  if (g_thread_pool_unprocessed (self->thread_pool) <
+      g_thread_pool_get_max_threads (self->thread_pool))
     {
-      /* do the blocking part of the validation in a thread */
-      g_thread_pool_push (self->thread_pool, res, NULL);
+      g_thread_pool_push (self->thread_pool, self, NULL);
     }
 }
 
-gboolean
-work_validator_validate_finish (WorkValidator  *self,
-                                GAsyncResult   *result,
-                                GError        **error)
+static void
+validate_job_in_place (WorkValidator *self, ValidationJob *job)
 {
-  GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (result);
+  validation_job_prepare (job);
+  sha256d_hash_header_from_midstate (job->midstate, job->header, job->hash);
+  job->verdict = validation_job_check (self, job);
 
-  g_return_val_if_fail (self != NULL, FALSE);
-  g_return_val_if_fail (g_simple_async_result_is_valid (result,
-                                                        NULL,
-                                                        work_validator_validate),
-                        FALSE);
+  report_verdict (self, job);
+}
 
-  return ! g_simple_async_result_propagate_error (res, error);
+/* the verdict is reported through the callback given to
+   work_validator_new(), possibly before this function returns */
+void
+work_validator_validate (WorkValidator *self, WorkResult *work_result)
+{
+  ValidationJob *job;
+
+  job = validation_job_new (self, work_result);
+
+  /* do a quick, non-blocking pre-validation */
+  job->verdict = prevalidate_work_result (self, job);
+
+  if (job->verdict != WORK_VALIDATOR_ERROR_SUCCESS)
+    {
+      report_verdict (self, job);
+    }
+  else if (can_validate_inline (self))
+    {
+      validate_job_in_place (self, job);
+    }
+  else
+    {
+      /* do the blocking part of the validation in a thread */
+      queue_job (self, job);
+    }
 }
 
 void
-work_validator_track_work_sent (WorkValidator   *self,
-                                WorkRequest     *work_request,
-                                JsonNode        *work_item,
-                                UpstreamService *upstream_service)
+work_validator_track_work_sent (WorkValidator *self,
+                                WorkRequest   *work_request,
+                                JsonNode      *work_item,
+                                BlockTemplate *block_template,
+                                const guint8  *extranonce)
 {
-  gchar *data;
+  const gchar *data;
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
   TrackedWork *tracked_work;
+  gboolean created;
   gchar *user;
 
-  gchar *merkle_root;
-
   data = work_item_get_data_hex (work_item);
   g_assert (strlen (data) == 256);
 
-  merkle_root = work_data_get_merkle_root_hex (data);
+  if (! block_template_work_data_to_header (data, header))
+    return;
 
-  work_request_get_client_info (work_request, &user, NULL, NULL, NULL);
+  tracked_work = work_table_insert (self->work_table, header, &created);
 
-  tracked_work = g_slice_new0 (TrackedWork);
-  tracked_work->upstream_service = upstream_service;
-  tracked_work->user = user;
-  memcpy (tracked_work->version, data + 0, 8);
-  memcpy (tracked_work->timestamp, data + 136, 8);
+  /* the same merkle root sent again, start over */
+  if (! created)
+    work_table_clear_nonces (self->work_table, tracked_work);
 
-  memset (tracked_work->nonces, 0, TRACK_NONCE_MAX);
-  tracked_work->nonce_count = 0;
+  work_table_set_block_template (self->work_table,
+                                 tracked_work,
+                                 block_template,
+                                 extranonce);
 
-  g_hash_table_insert (self->work_by_merkle_root, merkle_root, tracked_work);
+  work_request_get_client_info (work_request, &user, NULL, NULL, NULL);
+  tracked_work->user = work_table_intern (self->work_table, user);
+  g_free (user);
 
-  g_free (data);
+  tracked_work->timestamp = header_get_uint32 (header, 68);
+  tracked_work->timestamp_max = tracked_work->timestamp;
 }
 
-static void
-on_block_hash (GObject      *obj,
-               GAsyncResult *result,
-               gpointer      user_data)
+/* tracks the work a result was computed on, for work that is handed out
+   implicitly (e.g. Stratum jobs) rather than sent item by item */
+void
+work_validator_track_work_result (WorkValidator *self,
+                                  WorkResult    *work_result)
 {
-  WorkValidator *self = user_data;
-  JsonNode *json_result;
-  JsonNode *json_error;
-  GError *error = NULL;
-
-  if (! evd_jsonrpc_http_client_call_method_finish (EVD_JSONRPC_HTTP_CLIENT (obj),
-                                                    result,
-                                                    &json_result,
-                                                    &json_error,
-                                                    &error))
+  WorkTable *table;
+  const guint8 *header;
+  TrackedWork *tracked_work;
+  BlockTemplate *block_template;
+  gboolean created;
+
+  /* jobs on top of the previous block outlive the block change until
+     a clean template arrives, their shares are late, not invalid */
+  block_template = work_result_get_block_template (work_result);
+  if (block_template != NULL &&
+      self->has_block_hash &&
+      memcmp (block_template_get_prev_hash (block_template),
+              self->block_hash,
+              32) != 0)
     {
-      g_print ("Get block hash failed: %s\n", error->message);
-      g_error_free (error);
-
-      /* try again */
-      resolve_current_block_hash (self);
+      work_result_mark_stale (work_result);
     }
-  else
-    {
-      const gchar *block_hash;
-      gint i;
 
-      block_hash = json_node_get_string (json_result);
+  if (work_result_is_stale (work_result))
+    table = self->work_table_prev;
+  else
+    table = self->work_table;
 
-      self->block_hash = g_new0 (gchar, 65);
+  header = work_result_get_header (work_result);
+  if (table == NULL || header == NULL)
+    return;
 
-      /* change uint32 order to ease comparison during validation */
-      for (i=0; i<64; i=i+8)
-        memcpy (self->block_hash + i, block_hash + 64 - 8 - i, 8);
+  tracked_work = work_table_insert (table, header, &created);
+  if (created)
+    {
+      tracked_work->user = work_table_intern (table,
+                                              work_result_get_user (work_result));
 
-      json_node_free (json_result);
-      json_node_free (json_error);
+      /* Stratum miners roll the time of their job at will */
+      if (block_template != NULL)
+        {
+          tracked_work->timestamp = block_template_get_curtime (block_template);
+          tracked_work->timestamp_max =
+            tracked_work->timestamp + BLOCK_TEMPLATE_MAX_NTIME_DRIFT;
+        }
+      else
+        {
+          tracked_work->timestamp = header_get_uint32 (header, 68);
+          tracked_work->timestamp_max = tracked_work->timestamp;
+        }
     }
 }
 
-static void
-resolve_current_block_hash (WorkValidator *self)
+/* 'hash' is the new best block hash as found in headers */
+void
+work_validator_notify_new_block (WorkValidator *self,
+                                 guint          block,
+                                 const guint8  *hash)
 {
-  JsonNode *params;
-  JsonArray *arr;
-
-  params = json_node_new (JSON_NODE_ARRAY);
-  arr = json_array_new ();
-  json_node_set_array (params, arr);
-  json_array_add_int_element (arr, self->block_num);
-
-  evd_jsonrpc_http_client_call_method (self->rpc,
-                                       "getblockhash",
-                                       params,
-                                       NULL,
-                                       on_block_hash,
-                                       self);
-
-  json_array_unref (arr);
-  json_node_free (params);
+  memcpy (self->block_hash_prev, self->block_hash, 32);
+  self->has_block_hash_prev = self->has_block_hash;
+  memcpy (self->block_hash, hash, 32);
+  self->has_block_hash = TRUE;
+
+  self->last_not_ready_shares = self->not_ready_shares;
+  self->last_not_ready_time = self->not_ready_shares > 0 ?
+    g_get_monotonic_time () - self->not_ready_since : 0;
+  self->not_ready_shares = 0;
+
+  /* a new block is the busiest moment, don't spend it freeing */
+  if (self->work_table_prev != NULL)
+    g_thread_pool_push (self->reclaimer, self->work_table_prev, NULL);
+  self->work_table_prev = self->work_table;
+
+  self->work_table = work_table_new ();
 }
 
+/* shares that arrived on top of the latest block before the validator
+   was told of it, and for how long, in microseconds */
 void
-work_validator_notify_new_block (WorkValidator *self, guint block)
+work_validator_get_not_ready_window (WorkValidator *self,
+                                     guint         *shares,
+                                     gint64        *duration)
 {
-  self->block_num = block;
-
-  g_free (self->block_hash_prev);
-  self->block_hash_prev = self->block_hash;
-
-  if (self->work_by_merkle_root_prev != NULL)
-    g_hash_table_unref (self->work_by_merkle_root_prev);
-
-  self->work_by_merkle_root_prev = self->work_by_merkle_root;
-
-  self->work_by_merkle_root =
-    g_hash_table_new_full (g_str_hash,
-                           g_str_equal,
-                           g_free,
-                           (GDestroyNotify) tracked_work_free);
-
-  resolve_current_block_hash (self);
+  if (shares != NULL)
+    *shares = self->last_not_ready_shares;
+  if (duration != NULL)
+    *duration = self->last_not_ready_time;
 }
 
 void
 work_validator_set_target (WorkValidator *self, const gchar *target)
 {
-  hex_to_bin (target, 64, self->target, NULL);
+  hex_codec_decode (target, self->target, 32);
 }
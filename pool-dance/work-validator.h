@@ -28,7 +28,7 @@
 
 #include "work-request.h"
 #include "work-result.h"
-#include "upstream-service.h"
+#include "block-template.h"
 
 G_BEGIN_DECLS
 
@@ -47,28 +47,39 @@ typedef enum
 
 typedef struct _WorkValidator WorkValidator;
 
-WorkValidator * work_validator_new              (EvdJsonrpcHttpClient *rpc);
-void            work_validator_free             (WorkValidator *self);
+typedef void (* WorkValidatorVerdictCb) (WorkValidator      *self,
+                                         WorkResult         *work_result,
+                                         WorkValidatorError  verdict,
+                                         const gchar        *reason,
+                                         gpointer            user_data);
 
-void            work_validator_validate         (WorkValidator       *self,
-                                                 WorkResult          *work_result,
-                                                 GCancellable        *cancellable,
-                                                 GAsyncReadyCallback  callback,
-                                                 gpointer             user_data);
-gboolean        work_validator_validate_finish  (WorkValidator  *self,
-                                                 GAsyncResult   *result,
-                                                 GError        **error);
+WorkValidator * work_validator_new                  (GKeyFile                *config,
+                                                     WorkValidatorVerdictCb   callback,
+                                                     gpointer                 user_data,
+                                                     GError                 **error);
+void            work_validator_free                 (WorkValidator *self);
 
-void            work_validator_track_work_sent  (WorkValidator   *self,
-                                                 WorkRequest     *work_request,
-                                                 JsonNode        *work_item,
-                                                 UpstreamService *upstream_service);
+void            work_validator_validate             (WorkValidator *self,
+                                                     WorkResult    *work_result);
 
-void            work_validator_notify_new_block (WorkValidator *self,
-                                                 guint          block);
+void            work_validator_track_work_sent      (WorkValidator *self,
+                                                     WorkRequest   *work_request,
+                                                     JsonNode      *work_item,
+                                                     BlockTemplate *block_template,
+                                                     const guint8  *extranonce);
 
-void            work_validator_set_target       (WorkValidator *self,
-                                                 const gchar   *target);
+void            work_validator_track_work_result    (WorkValidator *self,
+                                                     WorkResult    *work_result);
+
+void            work_validator_notify_new_block     (WorkValidator *self,
+                                                     guint          block,
+                                                     const guint8  *hash);
+void            work_validator_get_not_ready_window (WorkValidator *self,
+                                                     guint         *shares,
+                                                     gint64        *duration);
+
+void            work_validator_set_target           (WorkValidator *self,
+                                                     const gchar   *target);
 
 G_END_DECLS
 
@@ -0,0 +1,405 @@
+/*
+ * test-block-template.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include <string.h>
+#include <evd.h>
+
+#include "block-template.h"
+#include "hex-codec.h"
+#include "sha256d.h"
+
+/* the genesis block reward address, and its pay-to-pubkey-hash script */
+#define PAYOUT_ADDRESS "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa"
+#define PAYOUT_SCRIPT \
+  "76a91462e907b15cbf27d5425399ebf6f0fb50ebb88f1888ac"
+
+#define P2SH_ADDRESS "3P14159f73E4gFr7JterCCQh9QjiTjiZrG"
+#define P2SH_SCRIPT  "a914e9c3dd0c07aac76179ebc76a6c78d4d67c6c160a87"
+
+#define GENESIS_HASH \
+  "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f"
+
+/* all but the coinbase of block 100000, whose merkle root is
+   f3e94742aca4b5ef85488dc37c06c3282295ffec960994b2c0d5ac2a25a95766.
+   The last one only has the legacy "hash" member */
+#define TRANSACTIONS                                                      \
+  "[{\"txid\": \"fff2525b8931402dd09222c50775608f"                        \
+  "75787bd2b87e56995a7bdd30f79702c4\", \"data\": \"01\"},"                \
+  " {\"txid\": \"6359f0868171b1d194cbee1af2f16ea5"                        \
+  "98ae8fad666d9b012c8ed2b79a236ec4\", \"data\": \"02\"},"                \
+  " {\"hash\": \"e9a66845e05d5abc0ad04ec80f774a7e"                        \
+  "585c6e8db975962d069a522137b80c1d\", \"data\": \"03\"}]"
+
+#define TEMPLATE_FORMAT                                                   \
+  "{\"version\": 536870912,"                                              \
+  " \"previousblockhash\": \"" GENESIS_HASH "\","                         \
+  " \"transactions\": %s,"                                                \
+  " \"coinbasevalue\": 5000000000,"                                       \
+  " \"bits\": \"1d00ffff\","                                              \
+  " \"height\": %u,"                                                      \
+  " \"curtime\": 1700000000"                                              \
+  "%s}"
+
+#define WITNESS_COMMITMENT \
+  "6a24aa21a9ed1111111111111111111111111111111111111111111111111111111111111111"
+
+/* coinbase parts around the extranonce, at height 300000 */
+#define COINBASE1                                                         \
+  "01000000010000000000000000000000000000000000000000000000000000000000"  \
+  "000000ffffffff1a03e0930408"
+#define COINBASE2                                                         \
+  "0c2f706f6f6c2d64616e63652fffffffff0100f2052a01000000"                  \
+  "19" PAYOUT_SCRIPT "00000000"
+#define WITNESS_COINBASE2                                                 \
+  "0c2f706f6f6c2d64616e63652fffffffff0200f2052a01000000"                  \
+  "19" PAYOUT_SCRIPT "0000000000000000"                                   \
+  "26" WITNESS_COMMITMENT "00000000"
+
+/* header for extranonce 0000000100000002, ntime 1700000123 and nonce
+   0x12345678 */
+#define HEADER                                                            \
+  "000000206fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d619000000"  \
+  "00001cab76672f19ce651dbebe0b969b1be3afb35013cda53af2804024dc9d6085be"  \
+  "7bf15365ffff001d78563412"
+
+#define WORK_DATA                                                         \
+  "200000000a8ce26f72b3f1b646a2a6c14ff763ae65831e939c085ae10019d668000000"\
+  "006776ab1c65ce192f0bbebe1de31b9b961350b3aff23aa5cddc244080be85609d6553"\
+  "f17b1d00ffff1234567800000080000000000000000000000000000000000000000000"\
+  "0000000000000000000000000000000000000080020000"
+
+static const guint8 extranonce[BLOCK_TEMPLATE_EXTRANONCE_SIZE] =
+  { 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02 };
+
+static BlockTemplate *
+new_template (const gchar  *transactions,
+              guint         height,
+              const gchar  *extra,
+              GError      **error)
+{
+  JsonParser *parser;
+  GByteArray *script;
+  BlockTemplate *tpl;
+  gchar *json;
+
+  json = g_strdup_printf (TEMPLATE_FORMAT, transactions, height, extra);
+
+  parser = json_parser_new ();
+  g_assert (json_parser_load_from_data (parser, json, -1, NULL));
+  g_free (json);
+
+  script = block_template_address_to_script (PAYOUT_ADDRESS, NULL);
+  g_assert (script != NULL);
+
+  tpl = block_template_new (json_parser_get_root (parser), script, error);
+
+  g_byte_array_unref (script);
+  g_object_unref (parser);
+
+  return tpl;
+}
+
+static void
+assert_bytes (const guint8 *bin, gsize size, const gchar *expected)
+{
+  gchar *hex;
+
+  hex = hex_codec_encode_dup (bin, size);
+  g_assert_cmpstr (hex, ==, expected);
+  g_free (hex);
+}
+
+static void
+test_address_to_script (void)
+{
+  GByteArray *script;
+  GError *error = NULL;
+
+  script = block_template_address_to_script (PAYOUT_ADDRESS, &error);
+  g_assert_no_error (error);
+  assert_bytes (script->data, script->len, PAYOUT_SCRIPT);
+  g_byte_array_unref (script);
+
+  script = block_template_address_to_script (P2SH_ADDRESS, &error);
+  g_assert_no_error (error);
+  assert_bytes (script->data, script->len, P2SH_SCRIPT);
+  g_byte_array_unref (script);
+
+  /* bad checksum */
+  script = block_template_address_to_script ("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNb",
+                                             &error);
+  g_assert (script == NULL);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_clear_error (&error);
+
+  /* not a base58 digit */
+  script = block_template_address_to_script ("1A1zP1eP5QGefi2DMPTfTL5SLmv7Divf0a",
+                                             &error);
+  g_assert (script == NULL);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_clear_error (&error);
+}
+
+/* BIP34 height push, followed by the extranonce push opcode, right
+   after the null outpoint */
+static void
+test_coinbase_height (void)
+{
+  const struct
+  {
+    guint height;
+    const gchar *script;
+  } heights[] =
+    {
+      { 0,       "170008" },
+      { 1,       "175108" },
+      { 16,      "176008" },
+      { 17,      "18011108" },
+      { 127,     "18017f08" },
+      { 128,     "1902800008" },
+      { 255,     "1902ff0008" },
+      { 256,     "1902000108" },
+      { 32767,   "1902ff7f08" },
+      { 32768,   "1a0300800008" },
+      { 300000,  "1a03e0930408" },
+      { 8388608, "1b040000800008" }
+    };
+  const gsize prefix_len = 4 + 1 + 36;
+  BlockTemplate *tpl;
+  GByteArray *coinbase1;
+  GError *error = NULL;
+  guint i;
+
+  for (i=0; i<G_N_ELEMENTS (heights); i++)
+    {
+      tpl = new_template ("[]", heights[i].height, "", &error);
+      g_assert_no_error (error);
+
+      g_assert_cmpuint (block_template_get_height (tpl), ==, heights[i].height);
+
+      coinbase1 = block_template_get_coinbase1 (tpl);
+      g_assert_cmpuint (coinbase1->len, >, prefix_len);
+      assert_bytes (coinbase1->data + prefix_len,
+                    coinbase1->len - prefix_len,
+                    heights[i].script);
+
+      block_template_unref (tpl);
+    }
+}
+
+static void
+test_coinbase (void)
+{
+  BlockTemplate *tpl;
+  GByteArray *coinbase;
+  GError *error = NULL;
+  guint8 prev_hash[32];
+  gint i;
+
+  tpl = new_template (TRANSACTIONS, 300000, "", &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (block_template_get_version (tpl), ==, 0x20000000);
+  g_assert_cmpuint (block_template_get_bits (tpl), ==, 0x1d00ffff);
+  g_assert_cmpuint (block_template_get_curtime (tpl), ==, 1700000000);
+
+  /* kept in header byte order */
+  for (i=0; i<32; i++)
+    prev_hash[i] = block_template_get_prev_hash (tpl)[31 - i];
+  assert_bytes (prev_hash, 32, GENESIS_HASH);
+
+  coinbase = block_template_get_coinbase1 (tpl);
+  assert_bytes (coinbase->data, coinbase->len, COINBASE1);
+
+  coinbase = block_template_get_coinbase2 (tpl);
+  assert_bytes (coinbase->data, coinbase->len, COINBASE2);
+
+  block_template_unref (tpl);
+
+  /* segwit templates add the witness commitment output */
+  tpl = new_template (TRANSACTIONS,
+                      300000,
+                      ", \"default_witness_commitment\": \""
+                      WITNESS_COMMITMENT "\"",
+                      &error);
+  g_assert_no_error (error);
+
+  coinbase = block_template_get_coinbase1 (tpl);
+  assert_bytes (coinbase->data, coinbase->len, COINBASE1);
+
+  coinbase = block_template_get_coinbase2 (tpl);
+  assert_bytes (coinbase->data, coinbase->len, WITNESS_COINBASE2);
+
+  block_template_unref (tpl);
+}
+
+static void
+test_merkle (void)
+{
+  BlockTemplate *tpl;
+  GError *error = NULL;
+  const guint8 *branch;
+  guint len;
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+
+  tpl = new_template ("[]", 300000, "", &error);
+  g_assert_no_error (error);
+
+  /* a lonely coinbase is its own merkle root */
+  block_template_get_merkle_branch (tpl, &len);
+  g_assert_cmpuint (len, ==, 0);
+
+  block_template_unref (tpl);
+
+  tpl = new_template (TRANSACTIONS, 300000, "", &error);
+  g_assert_no_error (error);
+
+  branch = block_template_get_merkle_branch (tpl, &len);
+  g_assert_cmpuint (len, ==, 2);
+  assert_bytes (branch, 32,
+                "c40297f730dd7b5a99567eb8d27b78758f607507c52292d02d4031895b52f2ff");
+  assert_bytes (branch + 32, 32,
+                "49aef42d78e3e9999c9e6ec9e1dddd6cb880bf3b076a03be1318ca789089308e");
+
+  block_template_build_header (tpl, extranonce, 1700000123, 0x12345678, header);
+  assert_bytes (header, BLOCK_TEMPLATE_HEADER_SIZE, HEADER);
+
+  block_template_unref (tpl);
+}
+
+static void
+test_block_hex (void)
+{
+  BlockTemplate *tpl;
+  GError *error = NULL;
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+  gchar *hex;
+
+  g_assert (hex_codec_decode (HEADER, header, BLOCK_TEMPLATE_HEADER_SIZE));
+
+  tpl = new_template (TRANSACTIONS, 300000, "", &error);
+  g_assert_no_error (error);
+
+  hex = block_template_build_block_hex (tpl, header, extranonce);
+  g_assert_cmpstr (hex, ==,
+                   HEADER "04" COINBASE1 "0000000100000002" COINBASE2 "010203");
+  g_free (hex);
+
+  block_template_unref (tpl);
+
+  /* segwit marker and flag, then the witness reserved value before the
+     lock time */
+  tpl = new_template (TRANSACTIONS,
+                      300000,
+                      ", \"default_witness_commitment\": \""
+                      WITNESS_COMMITMENT "\"",
+                      &error);
+  g_assert_no_error (error);
+
+  hex = block_template_build_block_hex (tpl, header, extranonce);
+  g_assert_cmpstr (hex, ==,
+                   HEADER "04"
+                   "01000000" "0001"
+                   "010000000000000000000000000000000000000000000000000000000000000000"
+                   "ffffffff1a03e0930408"
+                   "0000000100000002"
+                   "0c2f706f6f6c2d64616e63652fffffffff0200f2052a01000000"
+                   "19" PAYOUT_SCRIPT "0000000000000000"
+                   "26" WITNESS_COMMITMENT
+                   "0120"
+                   "0000000000000000000000000000000000000000000000000000000000000000"
+                   "00000000"
+                   "010203");
+  g_free (hex);
+
+  block_template_unref (tpl);
+}
+
+static void
+test_work_data (void)
+{
+  guint8 header[BLOCK_TEMPLATE_HEADER_SIZE];
+  guint8 back[BLOCK_TEMPLATE_HEADER_SIZE];
+  gchar data[BLOCK_TEMPLATE_WORK_DATA_SIZE + 1];
+
+  g_assert (hex_codec_decode (HEADER, header, BLOCK_TEMPLATE_HEADER_SIZE));
+
+  block_template_header_to_work_data (header, data);
+  g_assert_cmpstr (data, ==, WORK_DATA);
+
+  g_assert (block_template_work_data_to_header (data, back));
+  g_assert (memcmp (back, header, BLOCK_TEMPLATE_HEADER_SIZE) == 0);
+}
+
+static void
+test_invalid_transactions (void)
+{
+  const gchar *transactions[] =
+    {
+      /* no data */
+      "[{\"txid\": \"" GENESIS_HASH "\"}]",
+      /* data is not a string */
+      "[{\"txid\": \"" GENESIS_HASH "\", \"data\": 1}]",
+      "[{\"txid\": \"" GENESIS_HASH "\", \"data\": null}]",
+      /* no usable id */
+      "[{\"data\": \"01\"}]",
+      "[{\"txid\": \"01\", \"data\": \"01\"}]",
+      "[{\"txid\": 1, \"data\": \"01\"}]",
+      /* not an object */
+      "[\"" GENESIS_HASH "\"]",
+      /* not an array */
+      "{}"
+    };
+  BlockTemplate *tpl;
+  GError *error = NULL;
+  guint i;
+
+  for (i=0; i<G_N_ELEMENTS (transactions); i++)
+    {
+      tpl = new_template (transactions[i], 300000, "", &error);
+      g_assert (tpl == NULL);
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+      g_clear_error (&error);
+    }
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  sha256d_init ();
+  hex_codec_init ();
+
+  g_test_add_func ("/block-template/address-to-script", test_address_to_script);
+  g_test_add_func ("/block-template/coinbase-height", test_coinbase_height);
+  g_test_add_func ("/block-template/coinbase", test_coinbase);
+  g_test_add_func ("/block-template/merkle", test_merkle);
+  g_test_add_func ("/block-template/block-hex", test_block_hex);
+  g_test_add_func ("/block-template/work-data", test_work_data);
+  g_test_add_func ("/block-template/invalid-transactions",
+                   test_invalid_transactions);
+
+  return g_test_run ();
+}
@@ -0,0 +1,225 @@
+/*
+ * test-hex-codec.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "hex-codec.h"
+
+/* past two full AVX2 blocks, so every tail length is seen */
+#define MAX_SIZE 80
+
+typedef struct
+{
+  const gchar *name;
+  guint features;
+} Kernel;
+
+static const Kernel kernels[] =
+  {
+    { "generic", 0 },
+    { "ssse3",   HEX_CODEC_FEATURE_SSSE3 },
+    { "avx2",    HEX_CODEC_FEATURE_AVX2 }
+  };
+
+static gboolean
+use_kernel (const Kernel *kernel)
+{
+  if (hex_codec_init_with_features (kernel->features) != kernel->features)
+    {
+      g_test_message ("'%s' not supported by this CPU, skipped", kernel->name);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+fill_bytes (guint8 *bin, gsize size)
+{
+  gsize i;
+
+  for (i=0; i<size; i++)
+    bin[i] = i * 37 + 11;
+}
+
+/* what the codec should produce, one byte at a time */
+static void
+reference_encode (const guint8 *bin, gsize size, gchar *hex, guint swap)
+{
+  gsize i;
+
+  for (i=0; i<size; i++)
+    sprintf (hex + i*2, "%02x", bin[i ^ swap]);
+  hex[size*2] = '\0';
+}
+
+static void
+test_known_answers (gconstpointer data)
+{
+  const guint8 bytes[] =
+    {
+      0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+      0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+    };
+  const guint8 swapped[] =
+    {
+      0x33, 0x22, 0x11, 0x00, 0x77, 0x66, 0x55, 0x44,
+      0xbb, 0xaa, 0x99, 0x88, 0xff, 0xee, 0xdd, 0xcc
+    };
+  guint8 bin[16];
+  gchar hex[33];
+  gchar *dup;
+
+  if (! use_kernel (data))
+    return;
+
+  hex_codec_encode (bytes, 16, hex);
+  g_assert_cmpstr (hex, ==, "00112233445566778899aabbccddeeff");
+
+  hex_codec_encode_swap32 (bytes, 16, hex);
+  g_assert_cmpstr (hex, ==, "3322110077665544bbaa9988ffeeddcc");
+
+  dup = hex_codec_encode_dup (bytes, 16);
+  g_assert_cmpstr (dup, ==, "00112233445566778899aabbccddeeff");
+  g_free (dup);
+
+  g_assert (hex_codec_decode ("00112233445566778899AABBCCDDEEFF", bin, 16));
+  g_assert (memcmp (bin, bytes, 16) == 0);
+
+  g_assert (hex_codec_decode_swap32 ("00112233445566778899aabbccddeeff",
+                                     bin,
+                                     16));
+  g_assert (memcmp (bin, swapped, 16) == 0);
+
+  /* the terminating NUL is the only thing written for nothing */
+  hex[0] = 'x';
+  hex_codec_encode (bytes, 0, hex);
+  g_assert_cmpstr (hex, ==, "");
+}
+
+static void
+test_round_trip (gconstpointer data)
+{
+  guint8 bytes[MAX_SIZE];
+  guint8 bin[MAX_SIZE];
+  gchar expected[MAX_SIZE * 2 + 1];
+  gchar hex[MAX_SIZE * 2 + 1];
+  gchar upper[MAX_SIZE * 2 + 1];
+  gsize size;
+  gsize i;
+
+  if (! use_kernel (data))
+    return;
+
+  fill_bytes (bytes, MAX_SIZE);
+
+  for (size=0; size<=MAX_SIZE; size++)
+    {
+      reference_encode (bytes, size, expected, 0);
+
+      hex_codec_encode (bytes, size, hex);
+      g_assert_cmpstr (hex, ==, expected);
+
+      memset (bin, 0, sizeof (bin));
+      g_assert (hex_codec_decode (expected, bin, size));
+      g_assert (memcmp (bin, bytes, size) == 0);
+
+      for (i=0; i<size*2 + 1; i++)
+        upper[i] = g_ascii_toupper (expected[i]);
+
+      memset (bin, 0, sizeof (bin));
+      g_assert (hex_codec_decode (upper, bin, size));
+      g_assert (memcmp (bin, bytes, size) == 0);
+
+      if (size % 4 != 0)
+        continue;
+
+      reference_encode (bytes, size, expected, 3);
+
+      hex_codec_encode_swap32 (bytes, size, hex);
+      g_assert_cmpstr (hex, ==, expected);
+
+      memset (bin, 0, sizeof (bin));
+      g_assert (hex_codec_decode_swap32 (expected, bin, size));
+      g_assert (memcmp (bin, bytes, size) == 0);
+    }
+}
+
+/* a single bad character must be caught wherever it lands, in a SIMD
+   block or in the tail */
+static void
+test_invalid (gconstpointer data)
+{
+  const gchar bad[] = { 'g', 'G', '/', ':', '@', '`', ' ', '\x80' };
+  guint8 bytes[MAX_SIZE];
+  guint8 bin[MAX_SIZE];
+  gchar hex[MAX_SIZE * 2 + 1];
+  gsize size;
+  gsize pos;
+  guint i;
+
+  if (! use_kernel (data))
+    return;
+
+  fill_bytes (bytes, MAX_SIZE);
+
+  for (size=1; size<=MAX_SIZE; size++)
+    for (pos=0; pos<size*2; pos++)
+      for (i=0; i<G_N_ELEMENTS (bad); i++)
+        {
+          reference_encode (bytes, size, hex, 0);
+          hex[pos] = bad[i];
+
+          g_assert (! hex_codec_decode (hex, bin, size));
+          if (size % 4 == 0)
+            g_assert (! hex_codec_decode_swap32 (hex, bin, size));
+        }
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+  gchar *path;
+  guint i;
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (i=0; i<G_N_ELEMENTS (kernels); i++)
+    {
+      path = g_strdup_printf ("/hex-codec/%s/known-answers", kernels[i].name);
+      g_test_add_data_func (path, &kernels[i], test_known_answers);
+      g_free (path);
+
+      path = g_strdup_printf ("/hex-codec/%s/round-trip", kernels[i].name);
+      g_test_add_data_func (path, &kernels[i], test_round_trip);
+      g_free (path);
+
+      path = g_strdup_printf ("/hex-codec/%s/invalid", kernels[i].name);
+      g_test_add_data_func (path, &kernels[i], test_invalid);
+      g_free (path);
+    }
+
+  return g_test_run ();
+}
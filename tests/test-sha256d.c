@@ -0,0 +1,241 @@
+/*
+ * test-sha256d.c
+ *
+ * pool-dance: Simple, light-weight and efficient Bitcoin mining pool
+ *             <https://github.com/elima/pool-dance>
+ *
+ * Copyright (C) 2012, Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * Authors:
+ *   Eduardo Lima Mitev <elima@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * version 3, or (at your option) any later version as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Affero General Public License at http://www.gnu.org/licenses/agpl.html
+ * for more details.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "hex-codec.h"
+#include "sha256d.h"
+
+#define HEADER_SIZE 80
+
+/* enough headers for two full batches of eight plus a partial one */
+#define MAX_BATCH 20
+
+typedef struct
+{
+  const gchar *name;
+  guint features;
+} Kernel;
+
+typedef struct
+{
+  const gchar *data;
+  gsize size;
+  const gchar *hash;
+} Vector;
+
+static const Kernel kernels[] =
+  {
+    { "generic",     0 },
+    { "sha-ni",      SHA256D_FEATURE_SHA_NI },
+    { "avx2",        SHA256D_FEATURE_AVX2 },
+    { "sha-ni-avx2", SHA256D_FEATURE_SHA_NI | SHA256D_FEATURE_AVX2 }
+  };
+
+/* SHA256 (SHA256 (data)), spanning one, two and several blocks */
+static const Vector vectors[] =
+  {
+    { "", 0,
+      "5df6e0e2761359d30a8275058e299fcc0381534545f55cf43e41983f5d4c9456" },
+    { "abc", 3,
+      "4f8b42c22dd3729b519ba6f68d2da7cc5b2d606d05daed5ad5128cc03e6c6358" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56,
+      "0cffe17f68954dac3a84fb1458bd5ec99209449749b2b308b7cb55812f9563af" }
+  };
+
+#define THOUSAND_A_HASH \
+  "f2b6fd3c03e69a9201ec5826310c02da24d154d2fe3c9041527696bb1f693dce"
+
+#define GENESIS_HEADER \
+  "0100000000000000000000000000000000000000000000000000000000000000" \
+  "000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa" \
+  "4b1e5e4a29ab5f49ffff001d1dac2b7c"
+
+/* as shown by RPC, byte-reversed */
+#define GENESIS_HASH \
+  "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f"
+
+static gboolean
+use_kernel (const Kernel *kernel)
+{
+  if (sha256d_init_with_features (kernel->features) != kernel->features)
+    {
+      g_test_message ("'%s' not supported by this CPU, skipped", kernel->name);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+assert_hash (const guint8 *hash, const gchar *expected)
+{
+  gchar hex[65];
+
+  hex_codec_encode (hash, 32, hex);
+  g_assert_cmpstr (hex, ==, expected);
+}
+
+static void
+assert_reversed_hash (const guint8 *hash, const gchar *expected)
+{
+  guint8 reversed[32];
+  gint i;
+
+  for (i=0; i<32; i++)
+    reversed[i] = hash[31 - i];
+
+  assert_hash (reversed, expected);
+}
+
+static void
+load_genesis (guint8 *header)
+{
+  g_assert (hex_codec_decode (GENESIS_HEADER, header, HEADER_SIZE));
+}
+
+static void
+test_hash (gconstpointer data)
+{
+  guint8 hash[32];
+  guint8 thousand_a[1000];
+  guint i;
+
+  if (! use_kernel (data))
+    return;
+
+  for (i=0; i<G_N_ELEMENTS (vectors); i++)
+    {
+      sha256d_hash ((const guint8 *) vectors[i].data, vectors[i].size, hash);
+      assert_hash (hash, vectors[i].hash);
+    }
+
+  memset (thousand_a, 'a', sizeof (thousand_a));
+  sha256d_hash (thousand_a, sizeof (thousand_a), hash);
+  assert_hash (hash, THOUSAND_A_HASH);
+}
+
+static void
+test_header (gconstpointer data)
+{
+  guint8 header[HEADER_SIZE];
+  guint32 midstate[8];
+  guint8 hash[32];
+
+  if (! use_kernel (data))
+    return;
+
+  load_genesis (header);
+
+  sha256d_hash_header (header, hash);
+  assert_reversed_hash (hash, GENESIS_HASH);
+
+  memset (hash, 0, sizeof (hash));
+  sha256d_midstate (header, midstate);
+  sha256d_hash_header_from_midstate (midstate, header, hash);
+  assert_reversed_hash (hash, GENESIS_HASH);
+}
+
+/* every batch size, so that full, partial and mixed groups of lanes are
+   all checked against the plain one-by-one hashing */
+static void
+test_batch (gconstpointer data)
+{
+  guint8 headers[MAX_BATCH][HEADER_SIZE];
+  guint32 midstates[MAX_BATCH][8];
+  guint8 hashes[MAX_BATCH][32];
+  guint8 expected[MAX_BATCH][32];
+  const guint8 *header_ptrs[MAX_BATCH];
+  const guint32 *midstate_ptrs[MAX_BATCH];
+  guint8 *hash_ptrs[MAX_BATCH];
+  guint count;
+  guint i;
+
+  /* reference hashes, computed before switching kernels */
+  sha256d_init_with_features (0);
+
+  for (i=0; i<MAX_BATCH; i++)
+    {
+      load_genesis (headers[i]);
+
+      /* the genesis nonce stays in the last slot, the rest get their own */
+      if (i < MAX_BATCH - 1)
+        headers[i][76] = i;
+
+      sha256d_hash (headers[i], HEADER_SIZE, expected[i]);
+    }
+  assert_reversed_hash (expected[MAX_BATCH - 1], GENESIS_HASH);
+
+  if (! use_kernel (data))
+    return;
+
+  for (i=0; i<MAX_BATCH; i++)
+    {
+      sha256d_midstate (headers[i], midstates[i]);
+      header_ptrs[i] = headers[i];
+      midstate_ptrs[i] = midstates[i];
+      hash_ptrs[i] = hashes[i];
+    }
+
+  for (count=1; count<=MAX_BATCH; count++)
+    {
+      guint offset = MAX_BATCH - count;
+
+      memset (hashes, 0, sizeof (hashes));
+
+      sha256d_hash_headers_from_midstates (midstate_ptrs + offset,
+                                           header_ptrs + offset,
+                                           hash_ptrs + offset,
+                                           count);
+
+      for (i=offset; i<MAX_BATCH; i++)
+        g_assert (memcmp (hashes[i], expected[i], 32) == 0);
+    }
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+  gchar *path;
+  guint i;
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (i=0; i<G_N_ELEMENTS (kernels); i++)
+    {
+      path = g_strdup_printf ("/sha256d/%s/hash", kernels[i].name);
+      g_test_add_data_func (path, &kernels[i], test_hash);
+      g_free (path);
+
+      path = g_strdup_printf ("/sha256d/%s/header", kernels[i].name);
+      g_test_add_data_func (path, &kernels[i], test_header);
+      g_free (path);
+
+      path = g_strdup_printf ("/sha256d/%s/batch", kernels[i].name);
+      g_test_add_data_func (path, &kernels[i], test_batch);
+      g_free (path);
+    }
+
+  return g_test_run ();
+}